@@ -43,6 +43,7 @@ struct UI
     UI() {
         screen.init(850, 550);        
         dog = cv::imread("dog.png", 1);                
+        dogVersion = 0;
         screen.move(50, 50);    
         label_mui.font.scale = 2.4f;
         label_mui.disable(true); 
@@ -50,27 +51,33 @@ struct UI
     
     void home(App &app) {        
         std::string name = "Enter your name!!";
+        std::string userInput;
+        bool editing = false;
         while (1) {
             label(screen, "I am Label, there is a dog!", 30, 30, dog.cols, 30);
-            imglabel(screen, dog, 30, 100, dog.cols, dog.rows);        
+            imglabel(screen, dog, 30, 100, dog.cols, dog.rows, dogVersion);        
             if (mui::PRESSED == btn_darkit(screen, "Press me to dark the dog!", 30, 300, dog.cols, 30)) {
                 dog -= cv::Scalar(1,1,1);
-                imglabel.redraw(); 
+                ++dogVersion; // changed in place
             }
         
             if (mui::PRESSED == btn_lightit(screen, "Press me to light up the dog!", 30, 340, dog.cols, 30)) {
                 dog += cv::Scalar(1,1,1);
-                imglabel.redraw();
+                ++dogVersion;
             }
 
-            if (mui::CLICKED == label_edit(screen, name, 30, 380, dog.cols, 30)) {
-                std::string userInput;
+            if (mui::CLICKED == label_edit(screen, name, 30, 380, dog.cols, 30) && !keyboard.isOpen()) {
+                editing = true;
+                userInput.clear();
                 if (name != "Enter your name!!") userInput = name;
-                keyboard(screen, userInput, 445, 300, 400, mui::KB_CHAR);
-                if (userInput.size() > 0) {
+            }
+            
+            if (editing) { // the keyboard is drawn in this loop, nothing else stops for it
+                const int r = keyboard(screen, userInput, 445, 300, 400, mui::KB_CHAR);
+                if (r != mui::OPEN) editing = false;
+                if (r == mui::ENTERED && userInput.size() > 0) {
                     app.name = userInput;
                     name = userInput;
-                    label_edit.redraw();
                 }
             }
         
@@ -89,7 +96,7 @@ struct UI
                 break;
             }
                         
-            if (27 == screen.show()) {
+            if (27 == screen.show() && !editing) { // esc closes the keyboard first
                 app.status = App::QUIT;
                 break;
             }
@@ -97,6 +104,7 @@ struct UI
     }
 
     cv::Mat dog;
+    uint64_t dogVersion;
     mui::Screen screen;
     mui::Button btn_exit, btn_darkit, btn_lightit;
     mui::Label label, label_edit, label_mui;
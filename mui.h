@@ -22,6 +22,8 @@
  **             In order to squeeze the performance and make the behaviour
  **             consistent, Sui is created directly based on Xlib, if you
  **             have Xlib in your machine, enable it with USE_SUI.
+ **             With USE_HEADLESS (or the HEADLESS mode) screens only live in
+ **             memory, events are fed through the Screen for tests/profiling.
  **
  ***********************************************************************/
 
@@ -39,9 +41,32 @@
 #endif
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 #include <string>
+#include <deque>
+#include <vector>
+#include <list>
+#include <map>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <mutex>
 #include <stdarg.h>
+#include <limits.h>
+#include <float.h>
+#include <math.h>
 #include <opencv2/opencv.hpp>
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#if defined(MUI_USE_STB_TRUETYPE)
+#include "stb_truetype.h" // STB_TRUETYPE_IMPLEMENTATION is up to the application 
+#endif
 
 namespace mui {
 
@@ -66,6 +91,12 @@ static const int ALIGN_RIGHT  = 0x102;
 static const int KB_FULL = 0x103;
 static const int KB_CHAR = 0x104;
 static const int KB_NUM  = 0x105;
+static const int HEADLESS = 0x106; // screen mode, no window at all
+static const int FONT_ENGINE_HERSHEY = 0x107; // cv::putText 
+static const int FONT_ENGINE_BITMAP  = 0x108; // glyph atlas
+static const int OPEN      = 0x109; // Keyboard/MessageBox still waiting for the user
+static const int ENTERED   = 0x10A;
+static const int CANCELLED = 0x10B;
 
 struct Mouse
 {
@@ -75,32 +106,180 @@ struct Mouse
     bool isInside(const Rect &r) {
         return x >= r.x && x <= (r.x + r.width) && y >= r.y && y <= (r.y + r.height);
     }
+    void update(int e, int x, int y) {
+        this->x = x;
+        this->y = y;
+        justReleased = false;
+        if (e == cv::EVENT_LBUTTONDOWN) pressed = true;
+        else if (e == cv::EVENT_LBUTTONUP) {pressed = false; justReleased = true;}
+    }
 };
-static Mouse g_mouse;
- 
-static void
-mouseCallback(int e, int x, int y, int flags, void *p) {
-    g_mouse.x = x;
-    g_mouse.y = y;
-    g_mouse.justReleased = false;
-    if (e == cv::EVENT_LBUTTONDOWN) g_mouse.pressed = true;
-    else if (e == cv::EVENT_LBUTTONUP) {g_mouse.pressed = false; g_mouse.justReleased = true;}
+
+static uint64_t
+nowUs() {
+    using namespace std::chrono;
+    return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
 }
 
-static int
-mouseStatus(const Rect &r, uint mask = (uint)(-1), int defaultV = IDLE) {
-    int s = IDLE;
-    if (g_mouse.isInside(r)) {
-        if (g_mouse.justReleased) {                
-            g_mouse.justReleased = false; // reset
-            s = CLICKED;
+/*
+ * Input session file: "MUIR", uint32 version (2), then one InputRecord per event.
+ * Mouse records use OpenCV's event types, a FRAME_RECORD ends each frame and
+ * keeps the key returned by Screen::show in x.
+ */
+static const int FRAME_RECORD = -1;
+
+struct InputRecord
+{
+    uint32_t frame;
+    uint32_t delta; // microseconds since the previous record
+    int32_t type, x, y, flag; // 32 bits, special keys of waitKey go beyond 16
+};
+static const uint32_t INPUT_RECORD_VERSION = 2;
+
+struct InputRecorder
+{
+    InputRecorder() {fp = NULL; frame = 0; last = 0;}
+    ~InputRecorder() {close();}
+    
+    bool open(const string &path) {
+        const uint32_t version = INPUT_RECORD_VERSION;
+        close();
+        fp = fopen(path.c_str(), "wb");
+        if (fp == NULL) return false;
+        fwrite("MUIR", 1, 4, fp);
+        fwrite(&version, sizeof(version), 1, fp);
+        frame = 0;
+        last = nowUs();
+        return true;
+    }
+    
+    void close() {
+        if (fp) fclose(fp);
+        fp = NULL;
+    }
+    
+    void put(int type, int x, int y, int flag) {
+        if (fp == NULL) return;
+        const uint64_t now = nowUs();
+        const uint64_t delta = now - last;
+        InputRecord r;
+        r.frame = frame;
+        r.delta = delta > 0xFFFFFFFFu ? 0xFFFFFFFFu : (uint32_t)delta;
+        r.type = type; r.x = x; r.y = y; r.flag = flag;
+        fwrite(&r, sizeof(r), 1, fp);
+        last = now;
+    }
+    
+    void endFrame(int key) {
+        put(FRAME_RECORD, key, 0, 0);
+        ++frame;
+    }
+    
+    FILE *fp;
+    uint32_t frame;
+    uint64_t last;
+};
+static const int KEY_EVENT = -2; // InputEvent type of keys, x is the key
+
+struct InputEvent
+{
+    uint64_t time; // nowUs() when it arrived
+    int type, x, y, flag;
+};
+
+/*
+ * Bounded ring of the input since the last frame, so presses and releases 
+ * within one show() interval are all seen. Consecutive motion is merged, 
+ * when it's full new events are dropped and counted in overflows.
+ */
+struct InputQueue
+{
+    enum {CAPACITY = 256};
+    
+    InputQueue() {head = tail = 0; overflows = 0;}
+    
+    void push(int type, int x, int y, int flag) {
+        if (type == cv::EVENT_MOUSEMOVE && head != tail) {
+            InputEvent &last = ring[(tail - 1) % CAPACITY];
+            if (last.type == cv::EVENT_MOUSEMOVE) { // only the latest position matters
+                last.time = nowUs(); last.x = x; last.y = y; last.flag = flag;
+                return;
+            }
         }
-        else if (g_mouse.pressed) s = PRESSED;        
-        else s = HOVERED;
-    }    
-    s = s & mask;
-    return s == 0 ? defaultV : s;
-}
+        if (tail - head == CAPACITY) {
+            ++overflows;
+            return;
+        }
+        InputEvent &e = ring[tail % CAPACITY];
+        e.time = nowUs(); e.type = type; e.x = x; e.y = y; e.flag = flag;
+        ++tail;
+    }
+    
+    // move up to n of the oldest events to out, return how many
+    size_t take(InputEvent *out, size_t n) {
+        size_t i = 0;
+        for (; i < n && head != tail; ++i, ++head) out[i] = ring[head % CAPACITY];
+        return i;
+    }
+    
+    size_t size() const {return tail - head;}
+    
+    InputEvent ring[CAPACITY];
+    size_t head, tail;
+    uint64_t overflows;
+};
+
+// p is the Screen the input is for, screenInput takes it whether it's replayed or not
+static void mouseCallback(int e, int x, int y, int flags, void *p);
+static void screenInput(int e, int x, int y, int flags, void *p);
+
+struct InputReplayer
+{
+    InputReplayer() {pos = 0; realtime = false; start = elapsed = 0;}
+    
+    bool open(const string &path, bool realtime = false) {
+        char magic[4];
+        uint32_t version = 0;
+        InputRecord r;
+        FILE *fp = fopen(path.c_str(), "rb");
+        if (fp == NULL) return false;
+        records.clear();
+        if (fread(magic, 1, 4, fp) == 4 && memcmp(magic, "MUIR", 4) == 0 &&
+            fread(&version, sizeof(version), 1, fp) == 1 && version == INPUT_RECORD_VERSION) {
+            while (fread(&r, sizeof(r), 1, fp) == 1) records.push_back(r);
+        }
+        fclose(fp);
+        this->realtime = realtime;
+        pos = 0;
+        start = elapsed = 0;
+        return !records.empty();
+    }
+    
+    bool done() const {return pos >= records.size();}
+    
+    // feed the events of the next frame to screen p, return the key recorded for it, -1 when done
+    int play(void *p) {
+        if (start == 0) start = nowUs();
+        while (pos < records.size()) {
+            const InputRecord &r = records[pos++];
+            elapsed += r.delta;
+            if (realtime) {
+                const uint64_t now = nowUs();
+                if (start + elapsed > now) {
+                    std::this_thread::sleep_for(std::chrono::microseconds(start + elapsed - now));
+                }
+            }
+            if (r.type == FRAME_RECORD) return r.x;
+            screenInput(r.type, r.x, r.y, r.flag, p);
+        }
+        return -1;
+    }
+    
+    std::vector<InputRecord> records;
+    size_t pos;
+    bool realtime;
+    uint64_t start, elapsed;
+};
 
 static uint
 colorAdd(uint v, uint m) {
@@ -139,6 +318,375 @@ fill(Mat &area, const Point center, int radius, uint color) {
     cv::circle(area, center, radius, toScalar(color), -1, CV_AA);
 }
 
+/*
+ * Built-in 5x7 font for the bitmap engine, ASCII 32 to 126. Nine rows per 
+ * glyph, the baseline is under row 6, rows 7 and 8 hold descenders. 
+ */
+static const uint8_t g_font5x7[95 * 9] = {
+    0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00, //  
+    0x04,0x04,0x04,0x04,0x00,0x00,0x04,0x00,0x00, // !
+    0x0A,0x0A,0x0A,0x00,0x00,0x00,0x00,0x00,0x00, // "
+    0x0A,0x0A,0x1F,0x0A,0x1F,0x0A,0x0A,0x00,0x00, // #
+    0x04,0x0F,0x14,0x0E,0x05,0x1E,0x04,0x00,0x00, // $
+    0x18,0x19,0x02,0x04,0x08,0x13,0x03,0x00,0x00, // %
+    0x0C,0x12,0x14,0x08,0x15,0x12,0x0D,0x00,0x00, // &
+    0x0C,0x04,0x08,0x00,0x00,0x00,0x00,0x00,0x00, // '
+    0x02,0x04,0x08,0x08,0x08,0x04,0x02,0x00,0x00, // (
+    0x08,0x04,0x02,0x02,0x02,0x04,0x08,0x00,0x00, // )
+    0x00,0x04,0x15,0x0E,0x15,0x04,0x00,0x00,0x00, // *
+    0x00,0x04,0x04,0x1F,0x04,0x04,0x00,0x00,0x00, // +
+    0x00,0x00,0x00,0x00,0x0C,0x04,0x08,0x00,0x00, // ,
+    0x00,0x00,0x00,0x1F,0x00,0x00,0x00,0x00,0x00, // -
+    0x00,0x00,0x00,0x00,0x00,0x0C,0x0C,0x00,0x00, // .
+    0x00,0x01,0x02,0x04,0x08,0x10,0x00,0x00,0x00, // /
+    0x0E,0x11,0x13,0x15,0x19,0x11,0x0E,0x00,0x00, // 0
+    0x04,0x0C,0x04,0x04,0x04,0x04,0x0E,0x00,0x00, // 1
+    0x0E,0x11,0x01,0x02,0x04,0x08,0x1F,0x00,0x00, // 2
+    0x1F,0x02,0x04,0x02,0x01,0x11,0x0E,0x00,0x00, // 3
+    0x02,0x06,0x0A,0x12,0x1F,0x02,0x02,0x00,0x00, // 4
+    0x1F,0x10,0x1E,0x01,0x01,0x11,0x0E,0x00,0x00, // 5
+    0x06,0x08,0x10,0x1E,0x11,0x11,0x0E,0x00,0x00, // 6
+    0x1F,0x01,0x02,0x04,0x08,0x08,0x08,0x00,0x00, // 7
+    0x0E,0x11,0x11,0x0E,0x11,0x11,0x0E,0x00,0x00, // 8
+    0x0E,0x11,0x11,0x0F,0x01,0x02,0x0C,0x00,0x00, // 9
+    0x00,0x0C,0x0C,0x00,0x0C,0x0C,0x00,0x00,0x00, // :
+    0x00,0x0C,0x0C,0x00,0x0C,0x04,0x08,0x00,0x00, // ;
+    0x02,0x04,0x08,0x10,0x08,0x04,0x02,0x00,0x00, // <
+    0x00,0x00,0x1F,0x00,0x1F,0x00,0x00,0x00,0x00, // =
+    0x08,0x04,0x02,0x01,0x02,0x04,0x08,0x00,0x00, // >
+    0x0E,0x11,0x01,0x02,0x04,0x00,0x04,0x00,0x00, // ?
+    0x0E,0x11,0x01,0x0D,0x15,0x15,0x0E,0x00,0x00, // @
+    0x0E,0x11,0x11,0x11,0x1F,0x11,0x11,0x00,0x00, // A
+    0x1E,0x11,0x11,0x1E,0x11,0x11,0x1E,0x00,0x00, // B
+    0x0E,0x11,0x10,0x10,0x10,0x11,0x0E,0x00,0x00, // C
+    0x1C,0x12,0x11,0x11,0x11,0x12,0x1C,0x00,0x00, // D
+    0x1F,0x10,0x10,0x1E,0x10,0x10,0x1F,0x00,0x00, // E
+    0x1F,0x10,0x10,0x1E,0x10,0x10,0x10,0x00,0x00, // F
+    0x0E,0x11,0x10,0x17,0x11,0x11,0x0F,0x00,0x00, // G
+    0x11,0x11,0x11,0x1F,0x11,0x11,0x11,0x00,0x00, // H
+    0x0E,0x04,0x04,0x04,0x04,0x04,0x0E,0x00,0x00, // I
+    0x07,0x02,0x02,0x02,0x02,0x12,0x0C,0x00,0x00, // J
+    0x11,0x12,0x14,0x18,0x14,0x12,0x11,0x00,0x00, // K
+    0x10,0x10,0x10,0x10,0x10,0x10,0x1F,0x00,0x00, // L
+    0x11,0x1B,0x15,0x15,0x11,0x11,0x11,0x00,0x00, // M
+    0x11,0x11,0x19,0x15,0x13,0x11,0x11,0x00,0x00, // N
+    0x0E,0x11,0x11,0x11,0x11,0x11,0x0E,0x00,0x00, // O
+    0x1E,0x11,0x11,0x1E,0x10,0x10,0x10,0x00,0x00, // P
+    0x0E,0x11,0x11,0x11,0x15,0x12,0x0D,0x00,0x00, // Q
+    0x1E,0x11,0x11,0x1E,0x14,0x12,0x11,0x00,0x00, // R
+    0x0F,0x10,0x10,0x0E,0x01,0x01,0x1E,0x00,0x00, // S
+    0x1F,0x04,0x04,0x04,0x04,0x04,0x04,0x00,0x00, // T
+    0x11,0x11,0x11,0x11,0x11,0x11,0x0E,0x00,0x00, // U
+    0x11,0x11,0x11,0x11,0x11,0x0A,0x04,0x00,0x00, // V
+    0x11,0x11,0x11,0x15,0x15,0x15,0x0A,0x00,0x00, // W
+    0x11,0x11,0x0A,0x04,0x0A,0x11,0x11,0x00,0x00, // X
+    0x11,0x11,0x11,0x0A,0x04,0x04,0x04,0x00,0x00, // Y
+    0x1F,0x01,0x02,0x04,0x08,0x10,0x1F,0x00,0x00, // Z
+    0x0E,0x08,0x08,0x08,0x08,0x08,0x0E,0x00,0x00, // [
+    0x00,0x10,0x08,0x04,0x02,0x01,0x00,0x00,0x00, // backslash
+    0x0E,0x02,0x02,0x02,0x02,0x02,0x0E,0x00,0x00, // ]
+    0x04,0x0A,0x11,0x00,0x00,0x00,0x00,0x00,0x00, // ^
+    0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x1F, // _
+    0x08,0x04,0x02,0x00,0x00,0x00,0x00,0x00,0x00, // `
+    0x00,0x00,0x0E,0x01,0x0F,0x11,0x0F,0x00,0x00, // a
+    0x10,0x10,0x16,0x19,0x11,0x11,0x1E,0x00,0x00, // b
+    0x00,0x00,0x0E,0x10,0x10,0x11,0x0E,0x00,0x00, // c
+    0x01,0x01,0x0D,0x13,0x11,0x11,0x0F,0x00,0x00, // d
+    0x00,0x00,0x0E,0x11,0x1F,0x10,0x0E,0x00,0x00, // e
+    0x06,0x09,0x08,0x1C,0x08,0x08,0x08,0x00,0x00, // f
+    0x00,0x00,0x0F,0x11,0x11,0x0F,0x01,0x11,0x0E, // g
+    0x10,0x10,0x16,0x19,0x11,0x11,0x11,0x00,0x00, // h
+    0x04,0x00,0x0C,0x04,0x04,0x04,0x0E,0x00,0x00, // i
+    0x02,0x00,0x06,0x02,0x02,0x02,0x02,0x12,0x0C, // j
+    0x10,0x10,0x12,0x14,0x18,0x14,0x12,0x00,0x00, // k
+    0x0C,0x04,0x04,0x04,0x04,0x04,0x0E,0x00,0x00, // l
+    0x00,0x00,0x1A,0x15,0x15,0x11,0x11,0x00,0x00, // m
+    0x00,0x00,0x16,0x19,0x11,0x11,0x11,0x00,0x00, // n
+    0x00,0x00,0x0E,0x11,0x11,0x11,0x0E,0x00,0x00, // o
+    0x00,0x00,0x1E,0x11,0x11,0x1E,0x10,0x10,0x10, // p
+    0x00,0x00,0x0D,0x13,0x11,0x0F,0x01,0x01,0x01, // q
+    0x00,0x00,0x16,0x19,0x10,0x10,0x10,0x00,0x00, // r
+    0x00,0x00,0x0E,0x10,0x0E,0x01,0x1E,0x00,0x00, // s
+    0x08,0x08,0x1C,0x08,0x08,0x09,0x06,0x00,0x00, // t
+    0x00,0x00,0x11,0x11,0x11,0x13,0x0D,0x00,0x00, // u
+    0x00,0x00,0x11,0x11,0x11,0x0A,0x04,0x00,0x00, // v
+    0x00,0x00,0x11,0x11,0x15,0x15,0x0A,0x00,0x00, // w
+    0x00,0x00,0x11,0x0A,0x04,0x0A,0x11,0x00,0x00, // x
+    0x00,0x00,0x11,0x11,0x11,0x0F,0x01,0x11,0x0E, // y
+    0x00,0x00,0x1F,0x02,0x04,0x08,0x1F,0x00,0x00, // z
+    0x02,0x04,0x04,0x08,0x04,0x04,0x02,0x00,0x00, // {
+    0x04,0x04,0x04,0x04,0x04,0x04,0x04,0x00,0x00, // |
+    0x08,0x04,0x04,0x02,0x04,0x04,0x08,0x00,0x00, // }
+    0x00,0x00,0x08,0x15,0x02,0x00,0x00,0x00,0x00, // ~
+};
+
+// dst = dst*(255-a)/255 + c*a/255 for n bytes, exact rounding 
+static void
+blendRow(uint8_t *dst, const uint8_t *alpha, const uint8_t *color, int n) {
+    int i = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128(), full = _mm_set1_epi16(255), half = _mm_set1_epi16(128);
+    for (; i + 16 <= n; i += 16) {
+        const __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        const __m128i a = _mm_loadu_si128((const __m128i *)(alpha + i));
+        const __m128i c = _mm_loadu_si128((const __m128i *)(color + i));
+        __m128i r[2];
+        for (int k = 0; k < 2; ++k) {
+            const __m128i d16 = k ? _mm_unpackhi_epi8(d, zero) : _mm_unpacklo_epi8(d, zero);
+            const __m128i a16 = k ? _mm_unpackhi_epi8(a, zero) : _mm_unpacklo_epi8(a, zero);
+            const __m128i c16 = k ? _mm_unpackhi_epi8(c, zero) : _mm_unpacklo_epi8(c, zero);
+            __m128i t = _mm_add_epi16(_mm_mullo_epi16(d16, _mm_sub_epi16(full, a16)), _mm_mullo_epi16(c16, a16));
+            t = _mm_add_epi16(t, half);
+            r[k] = _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+        }
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(r[0], r[1]));
+    }
+#elif defined(__ARM_NEON)
+    const uint8x8_t full = vdup_n_u8(255);
+    for (; i + 8 <= n; i += 8) {
+        const uint8x8_t a = vld1_u8(alpha + i);
+        uint16x8_t t = vmull_u8(vld1_u8(dst + i), vsub_u8(full, a));
+        t = vmlal_u8(t, vld1_u8(color + i), a);
+        vst1_u8(dst + i, vraddhn_u16(t, vrshrq_n_u16(t, 8)));
+    }
+#endif
+    for (; i < n; ++i) {
+        const int t = dst[i] * (255 - alpha[i]) + color[i] * alpha[i] + 128;
+        dst[i] = (uint8_t)((t + (t >> 8)) >> 8);
+    }
+}
+
+struct Glyph
+{
+    Rect rect;       // in the atlas
+    int dx, dy;      // top left of rect relative to the pen on the baseline
+    int advance;
+};
+
+/*
+ * Alpha of all printable ASCII glyphs, rasterized once per font and size. 
+ * Text is composed from the glyph quads and blended into the area in one pass.
+ */
+struct GlyphAtlas
+{
+    GlyphAtlas() {ascent = descent = 0;}
+    
+    // the built-in font, scale as cv::putText's with the simplex font, snapped to whole pixels
+    void build(float scale) {
+        const int k = std::max(1, cvRound(scale * 22 / 7));
+        alpha = Mat(9 * k, 95 * 6 * k, CV_8UC1, Scalar(0));
+        for (int i = 0; i < 95; ++i) {
+            Glyph &g = glyphs[i];
+            g.rect = Rect(i * 6 * k, 0, 6 * k, 9 * k);
+            g.dx = 0; g.dy = -7 * k;
+            g.advance = 6 * k;
+            for (int r = 0; r < 9; ++r) {
+                for (int c = 0; c < 5; ++c) {
+                    if (g_font5x7[i * 9 + r] & (0x10 >> c)) {
+                        alpha(Rect(g.rect.x + c * k, r * k, k, k)) = Scalar(255);
+                    }
+                }
+            }
+        }
+        ascent = 7 * k;
+        descent = 2 * k;
+    }
+
+#if defined(MUI_USE_STB_TRUETYPE)
+    // glyphs of a ttf file, the height of 'H' matches the built-in font at the same scale
+    bool load(const string &path, float scale) {
+        std::vector<unsigned char> data;
+        FILE *fp = fopen(path.c_str(), "rb");
+        if (fp == NULL) return false;
+        unsigned char buf[4096];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) data.insert(data.end(), buf, buf + n);
+        fclose(fp);
+        
+        stbtt_fontinfo info;
+        if (data.empty() || !stbtt_InitFont(&info, &data[0], stbtt_GetFontOffsetForIndex(&data[0], 0))) return false;
+        int x0, y0, x1, y1;
+        if (!stbtt_GetCodepointBox(&info, 'H', &x0, &y0, &x1, &y1) || y1 <= 0) return false;
+        const float s = (scale * 22) / y1;
+        
+        int width = 0, top = 0, bottom = 0;
+        for (int i = 0; i < 95; ++i) {
+            int adv, lsb;
+            stbtt_GetCodepointBitmapBox(&info, 32 + i, s, s, &x0, &y0, &x1, &y1);
+            stbtt_GetCodepointHMetrics(&info, 32 + i, &adv, &lsb);
+            glyphs[i].rect = Rect(width, 0, x1 - x0, y1 - y0);
+            glyphs[i].dx = x0; glyphs[i].dy = y0;
+            glyphs[i].advance = cvRound(adv * s);
+            width += x1 - x0;
+            top = std::min(top, y0);
+            bottom = std::max(bottom, y1);
+        }
+        alpha = Mat(std::max(1, bottom - top), std::max(1, width), CV_8UC1, Scalar(0));
+        for (int i = 0; i < 95; ++i) {
+            const Rect &r = glyphs[i].rect;
+            if (r.area() > 0) stbtt_MakeCodepointBitmap(&info, alpha.ptr(0) + r.x, r.width, r.height, (int)alpha.step, s, s, 32 + i);
+        }
+        ascent = cvRound(scale * 22);
+        descent = bottom;
+        return true;
+    }
+#endif
+
+    const Glyph &glyph(char c) const {
+        return glyphs[(c < 32 || c > 126) ? '?' - 32 : c - 32];
+    }
+    
+    // same meaning as cv::getTextSize: height above the baseline, baseline the part below 
+    Size getTextSize(const string &text, int *baseline = NULL) const {
+        int w = 0;
+        for (size_t i = 0; i < text.size(); ++i) w += glyph(text[i]).advance;
+        if (baseline) *baseline = descent;
+        return Size(w, ascent);
+    }
+    
+    // org is the left end of the baseline, as with cv::putText
+    void draw(Mat &area, const string &text, Point org, uint color) const {
+        int x0 = INT_MAX, y0 = INT_MAX, x1 = INT_MIN, y1 = INT_MIN, pen = 0;
+        for (size_t i = 0; i < text.size(); ++i) {
+            const Glyph &g = glyph(text[i]);
+            if (g.rect.area() > 0) {
+                x0 = std::min(x0, pen + g.dx); x1 = std::max(x1, pen + g.dx + g.rect.width);
+                y0 = std::min(y0, g.dy);       y1 = std::max(y1, g.dy + g.rect.height);
+            }
+            pen += g.advance;
+        }
+        if (x1 <= x0 || y1 <= y0) return;
+        
+        const Rect box(org.x + x0, org.y + y0, x1 - x0, y1 - y0);
+        const Rect clipped = box & Rect(0, 0, area.cols, area.rows);
+        if (clipped.area() <= 0) return;
+        
+        Mat mask(box.size(), CV_8UC1, Scalar(0));
+        pen = 0;
+        for (size_t i = 0; i < text.size(); ++i) {
+            const Glyph &g = glyph(text[i]);
+            if (g.rect.area() > 0) {
+                Mat quad = mask(Rect(pen + g.dx - x0, g.dy - y0, g.rect.width, g.rect.height));
+                cv::max(quad, alpha(g.rect), quad); // quads may overlap with ttf
+            }
+            pen += g.advance;
+        }
+        
+        const int cn = area.channels(), n = clipped.width * cn;
+        const Scalar sc = toScalar(color);
+        std::vector<uint8_t> colors(n), alphas(n);
+        for (int i = 0; i < n; ++i) colors[i] = (uint8_t)sc[i % cn];
+        for (int r = 0; r < clipped.height; ++r) {
+            const uint8_t *a = mask.ptr(clipped.y - box.y + r) + clipped.x - box.x;
+            for (int i = 0; i < n; ++i) alphas[i] = a[i / cn];
+            blendRow(area.ptr(clipped.y + r) + clipped.x * cn, &alphas[0], &colors[0], n);
+        }
+    }
+    
+    Mat alpha;
+    Glyph glyphs[95];
+    int ascent, descent;
+};
+
+// atlases are shared by all fonts of the same file and scale, "" is the built-in font 
+static const GlyphAtlas *
+getGlyphAtlas(const string &ttf, float scale) {
+    static thread_local std::map<string, GlyphAtlas> atlases;
+    char key[32];
+    snprintf(key, sizeof(key), "%g|", scale);
+    const string k = key + ttf;
+    std::map<string, GlyphAtlas>::iterator it = atlases.find(k);
+    if (it != atlases.end()) return &it->second;
+    
+    GlyphAtlas &atlas = atlases[k];
+#if defined(MUI_USE_STB_TRUETYPE)
+    if (!ttf.empty() && atlas.load(ttf, scale)) return &atlas;
+#endif
+    atlas.build(scale);
+    return &atlas;
+}
+
+/*
+ * LRU cache of rendered bitmaps, keyed by everything that went into drawing 
+ * them. Text entries keep the text drawn on its background plus the mask of
+ * the touched pixels, so a repaint is one masked copy instead of rasterizing
+ * the strokes again; widget entries keep a whole widget in one state. 
+ * capacity (bytes) bounds the memory, 0 turns the cache off. Hold mutex 
+ * around find/put and while using the entry they return, screens on other 
+ * threads may share the cache.
+ */
+struct BitmapCache
+{
+    struct Entry
+    {
+        string key;
+        Mat patch, mask; // mask is empty for widgets
+        Size size;  // from cv::getTextSize
+        Point org;  // where the text origin is in patch
+    };
+    
+    BitmapCache(size_t capacity) {this->capacity = capacity; bytes = 0; hits = misses = 0;}
+    
+    const Entry *find(const string &key) {
+        std::map<string, std::list<Entry>::iterator>::iterator it = index.find(key);
+        if (it == index.end()) {
+            ++misses;
+            return NULL;
+        }
+        ++hits;
+        lru.splice(lru.begin(), lru, it->second); // most recently used first
+        return &lru.front();
+    }
+    
+    const Entry *put(const Entry &e) {
+        std::map<string, std::list<Entry>::iterator>::iterator it = index.find(e.key);
+        if (it != index.end()) { // replaced 
+            bytes -= entryBytes(*it->second);
+            lru.erase(it->second);
+        }
+        lru.push_front(e);
+        index[e.key] = lru.begin();
+        bytes += entryBytes(e);
+        while (bytes > capacity && lru.size() > 1) evict();
+        return &lru.front();
+    }
+    
+    void setCapacity(size_t capacity) {
+        std::lock_guard<std::mutex> lock(mutex);
+        this->capacity = capacity;
+        while (bytes > capacity && !lru.empty()) evict();
+    }
+    
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex);
+        lru.clear();
+        index.clear();
+        bytes = 0;
+    }
+    
+    size_t capacity, bytes;
+    uint64_t hits, misses;
+    std::mutex mutex;
+    
+private:
+    static size_t entryBytes(const Entry &e) {
+        return e.key.size() + e.patch.total() * e.patch.elemSize() + e.mask.total();
+    }
+    
+    void evict() {
+        bytes -= entryBytes(lru.back());
+        index.erase(lru.back().key);
+        lru.pop_back();
+    }
+    
+    std::list<Entry> lru;
+    std::map<string, std::list<Entry>::iterator> index;
+};
+// one of each in the process, for all screens and threads (inline, so every 
+// translation unit gets the same one); capacity bounds them all together
+inline BitmapCache &textCache() {static BitmapCache cache(1 << 20); return cache;}
+inline BitmapCache &stateCache() {static BitmapCache cache(1 << 20); return cache;} // for widgets that opt in
+
 struct Font
 {
     Font() {
@@ -147,11 +695,22 @@ struct Font
         type           = cv::FONT_HERSHEY_SIMPLEX;
         AA             = CV_AA;
         scale          = 0.45f;
+        cached         = true;
+        cache          = NULL;
+        engine         = FONT_ENGINE_HERSHEY;
+    }
+    
+    Size getTextSize(const string &text, int *baseline = NULL) {
+        if (engine == FONT_ENGINE_BITMAP) return getGlyphAtlas(ttf, scale)->getTextSize(text, baseline);
+        return cv::getTextSize(text, type, scale, 1, baseline);
     }
     
     Point getTextPosition(const string &text, const Rect &roi, int align) {
+        return getTextPosition(getTextSize(text), roi, align);
+    }
+    
+    Point getTextPosition(const Size &tsz, const Rect &roi, int align) {
         Point pos;
-        const Size tsz = cv::getTextSize(text, type, scale, 1, NULL);
         pos.y = roi.y + (roi.height + tsz.height)/2 - 1;
         switch(align) {
         case ALIGN_LEFT:  pos.x =  roi.x + 1; break;
@@ -161,14 +720,38 @@ struct Font
         return pos;
     }
     
-    void putText(Mat &area, const Rect &roi, const string &text, bool disabled = false, int align = ALIGN_CENTER) {
+    // bg: the color area is filled with under the text, it's cached then, -1 if unknown
+    void putText(Mat &area, const Rect &roi, const string &text, bool disabled = false, int align = ALIGN_CENTER, int bg = -1) {
         const uint c = disabled ? color_disabled : color;
-        const Point pos = getTextPosition(text, roi, align);
-        cv::putText(area, text, pos, type, scale, toScalar(c), 1, AA);
+        if (engine == FONT_ENGINE_BITMAP) { // cheap enough without the cache
+            getGlyphAtlas(ttf, scale)->draw(area, text, getTextPosition(text, roi, align), c);
+            return;
+        }
+        BitmapCache *tc = cached ? (cache ? cache : &textCache()) : NULL;
+        if (bg < 0 || tc == NULL || tc->capacity == 0) {
+            const Point pos = getTextPosition(text, roi, align);
+            cv::putText(area, text, pos, type, scale, toScalar(c), 1, AA);
+            return;
+        }
+        
+        char head[64];
+        snprintf(head, sizeof(head), "%d %g %d %d %x %x|", area.type(), scale, type, AA, c, (uint)bg);
+        const string key = head + text;
+        std::lock_guard<std::mutex> lock(tc->mutex);
+        const BitmapCache::Entry *e = tc->find(key);
+        if (e == NULL) e = tc->put(render(key, text, area.type(), c, bg));
+        
+        const Point pos = getTextPosition(e->size, roi, align);
+        const Rect dst(pos.x - e->org.x, pos.y - e->org.y, e->patch.cols, e->patch.rows);
+        const Rect clipped = dst & Rect(0, 0, area.cols, area.rows);
+        if (clipped.area() <= 0) return;
+        const Rect src(clipped.x - dst.x, clipped.y - dst.y, clipped.width, clipped.height);
+        Mat target = area(clipped);
+        e->patch(src).copyTo(target, e->mask(src));
     }
     
-    void putText(Mat &area, const string &text, bool disable = false, int align = ALIGN_CENTER) {
-        putText(area, Rect(0,0,area.cols, area.rows), text, disable, align);
+    void putText(Mat &area, const string &text, bool disable = false, int align = ALIGN_CENTER, int bg = -1) {
+        putText(area, Rect(0,0,area.cols, area.rows), text, disable, align, bg);
     }
     
     int color;
@@ -176,74 +759,501 @@ struct Font
     int type;
     int AA;
     float scale;    
+    bool cached;        // false to always rasterize
+    BitmapCache *cache; // NULL for the shared textCache()
+    int engine;       // FONT_ENGINE_HERSHEY or FONT_ENGINE_BITMAP
+    string ttf;       // bitmap engine with MUI_USE_STB_TRUETYPE, "" for the built-in font
+
+    // everything about the font that changes how text looks
+    string fingerprint() const {
+        char buf[96];
+        snprintf(buf, sizeof(buf), "%g %d %d %d %x %x|", scale, type, AA, engine, color, color_disabled);
+        return buf + ttf + "|";
+    }
+    
+private:
+    BitmapCache::Entry render(const string &key, const string &text, int areaType, uint c, int bg) {
+        const int pad = 3; // anti-aliased strokes reach a bit out of the text box
+        int baseline = 0;
+        BitmapCache::Entry e;
+        e.key  = key;
+        e.size = cv::getTextSize(text, type, scale, 1, &baseline);
+        e.org  = Point(pad, pad + e.size.height);
+        const Size psz(e.size.width + 2*pad, e.size.height + baseline + 2*pad);
+        e.patch = Mat(psz, areaType, toScalar(bg));
+        e.mask  = Mat(psz, CV_8UC1, Scalar(0));
+        cv::putText(e.patch, text, e.org, type, scale, toScalar(c), 1, AA);
+        cv::putText(e.mask, text, e.org, type, scale, Scalar(255), 1, AA);
+        return e;
+    }
 };
 
+/*
+ * Uniform grid over the widget rects registered in a frame. The rects of the
+ * previous frame decide which widget is under the pointer, the one registered
+ * last (drawn on top) wins, so overlapping widgets don't race for a click.
+ */
+struct HitGrid
+{
+    HitGrid() {cols = rows = 0; cell = 32;}
+    
+    void add(const void *id, const Rect &r) {
+        Entry e;
+        e.id = id; e.rect = r;
+        entries.push_back(e);
+    }
+    
+    // index the rects added since the last build, forget the older ones
+    void build(int w, int h) {
+        indexed.swap(entries);
+        entries.clear();
+        cols = (w + cell - 1) / cell;
+        rows = (h + cell - 1) / cell;
+        cells.resize(cols * rows);
+        for (size_t i = 0; i < cells.size(); ++i) cells[i].clear();
+        for (size_t i = 0; i < indexed.size(); ++i) {
+            const Rect &r = indexed[i].rect;
+            // Mouse::isInside counts the right and bottom edges in 
+            const int x0 = std::max(0, r.x / cell), x1 = std::min(cols - 1, (r.x + r.width) / cell);
+            const int y0 = std::max(0, r.y / cell), y1 = std::min(rows - 1, (r.y + r.height) / cell);
+            for (int y = y0; y <= y1; ++y) {
+                for (int x = x0; x <= x1; ++x) cells[y * cols + x].push_back((int)i);
+            }
+        }
+    }
+    
+    // the topmost widget containing (x, y), NULL if none
+    const void *find(int x, int y) const {
+        if (x < 0 || y < 0 || x / cell >= cols || y / cell >= rows) return NULL;
+        const std::vector<int> &c = cells[(y / cell) * cols + x / cell];
+        for (size_t i = c.size(); i-- > 0; ) {
+            const Rect &r = indexed[c[i]].rect;
+            if (x >= r.x && x <= (r.x + r.width) && y >= r.y && y <= (r.y + r.height)) return indexed[c[i]].id;
+        }
+        return NULL;
+    }
+    
+private:
+    struct Entry
+    {
+        const void *id;
+        Rect rect;
+    };
+    
+    int cols, rows, cell;
+    std::vector<Entry> entries, indexed;
+    std::vector<std::vector<int> > cells;
+};
+
+// the cache of a widget that opted in to cached states, NULL when it didn't
+static BitmapCache *
+widgetCache(bool cached, BitmapCache *cache) {
+    return !cached ? NULL : cache ? cache : &stateCache();
+}
+
+// the cached look of a widget into area, false if it has to be drawn (and stored after)
+static bool
+blitCached(BitmapCache *cache, const string &key, Mat &area) {
+    if (cache == NULL || cache->capacity == 0) return false;
+    std::lock_guard<std::mutex> lock(cache->mutex);
+    const BitmapCache::Entry *e = cache->find(key);
+    if (e == NULL) return false;
+    e->patch.copyTo(area);
+    return true;
+}
+
+static void
+storeCached(BitmapCache *cache, const string &key, const Mat &area) {
+    if (cache == NULL || cache->capacity == 0) return;
+    BitmapCache::Entry e;
+    e.key = key;
+    e.patch = area.clone();
+    std::lock_guard<std::mutex> lock(cache->mutex);
+    cache->put(e);
+}
+
 struct Screen
 {
     Screen() {
 #if defined(USE_SUI)
         sui = NULL;
 #endif
+        direct = false;
+        headless = false;
+        replayer = NULL;
+        recorder = NULL;
+        hot = NULL;
+        hotX = hotY = INT_MIN;
+        pointerDown = false;
+        lastKey = -1;
     }    
-    Screen(int w, int h, int mode = 0) {
+    Screen(int w, int h, int mode = 0, bool direct = false) {
 #if defined(USE_SUI)
         sui = NULL;
 #endif
-        init(w,h,mode);
+        replayer = NULL;
+        recorder = NULL;
+        init(w,h,mode,direct);
     }
+    // the window callbacks hold this, a copy would leave them pointing at the original
+    Screen(const Screen &) = delete;
+    Screen &operator=(const Screen &) = delete;
     
-    int init(int w, int h, int mode = 0) {
-        color  = 0x1E2027;
-        width  = w;
-        height = h;
-        bg = Mat(Size(w, h), CV_8UC3, toScalar(color));
+    // mode: 0 window, 1 full screen, HEADLESS only in memory
+    // with direct, widgets draw into Sui's framebuffer and showing costs no copy 
+    int init(int w, int h, int mode = 0, bool direct = false) {
 #if defined(USE_SUI)
-        if (sui) sui_destroy(&sui);
-        sui = sui_create(w, h, mode);
-        sui_setcallback(sui, &mouseCallback, NULL);
+        return init(NULL, w, h, mode, direct);
 #else 
+        setup(w, h, mode);
+        if (headless) return 0;
         wname = "Mui";
         cv::namedWindow(wname, CV_WINDOW_AUTOSIZE);
-        cv::setMouseCallback(wname, &mouseCallback, NULL);
+        cv::setMouseCallback(wname, &mouseCallback, this);
         cv::setWindowProperty(wname, CV_WND_PROP_FULLSCREEN, CV_WINDOW_FULLSCREEN);
+        return 0;
 #endif
+    }
+
+#if defined(USE_SUI)
+    // screens created in the same ctx share one X connection and one event loop 
+    int init(SuiContext *ctx, int w, int h, int mode = 0, bool direct = false) {
+        setup(w, h, mode);
+        if (sui) sui_destroy(&sui);
+        if (headless) return 0;
+        sui = ctx ? sui_context_create_window(ctx, w, h, mode) : sui_create(w, h, mode);
+        sui_setcallback(sui, &mouseCallback, this);
+        if (direct) this->direct = lockFramebuffer();
+        if (this->direct) bg = toScalar(color);
         return 0;
     }
+#endif
+
+    void setup(int w, int h, int mode) {
+        color  = 0x1E2027;
+        width  = w;
+        height = h;
+        direct = false;
+        headless = mode == HEADLESS;
+#if defined(USE_HEADLESS)
+        headless = true;
+#endif
+        keys.clear();
+        pendingKeys.clear();
+        frameTime = 0;
+        lastShown = 0;
+        lastKey = -1;
+        hot = NULL;
+        hotX = hotY = INT_MIN;
+        clicks.clear();
+        pointerDown = false;
+        bg = Mat(Size(w, h), CV_8UC3, toScalar(color));
+        invalidate();
+    }
+
+    // mark a region of bg as changed, show() only sends the changed regions
+    void invalidate(const Rect &roi) {
+        Rect r = roi & Rect(0, 0, bg.cols, bg.rows);
+        if (r.area() <= 0) return;
+        for (size_t i = 0; i < damage.size(); ) { // merge the ones it overlaps or touches
+            const Rect grown(r.x - 1, r.y - 1, r.width + 2, r.height + 2);
+            if ((grown & damage[i]).area() > 0) {
+                r |= damage[i];
+                damage[i] = damage.back();
+                damage.pop_back();
+                i = 0; // r grew, check again
+            }
+            else ++i;
+        }
+        damage.push_back(r);
+        if (damage.size() > MAX_DAMAGE) { // too scattered, send the bounding box
+            for (size_t i = 1; i < damage.size(); ++i) damage[0] |= damage[i];
+            damage.resize(1);
+        }
+    }
+    void invalidate() {invalidate(Rect(0, 0, bg.cols, bg.rows));}
+    
+    // true if something drew into roi since the last present()
+    bool isDamaged(const Rect &roi) const {
+        for (size_t i = 0; i < damage.size(); ++i) {
+            if ((damage[i] & roi).area() > 0) return true;
+        }
+        return false;
+    }
+    
+    // synthetic input for headless screens, handled like the real ones 
+    void feedMouse(int e, int x, int y, int flags = 0) {screenInput(e, x, y, flags, this);}
+    void feedKey(int key) {keys.push_back(key);}
     
 #if defined(USE_SUI)
     ~Screen() {sui_destroy(&sui);}
 #endif
     
     void move(int nx, int ny) {
+        if (headless) return;
 #if defined(USE_SUI)
         sui_move(sui, nx, ny);
 #else
         cv::moveWindow(wname, nx, ny);
 #endif
     }
-    void clear() {bg = toScalar(color);}
-    void clear(const Rect &roi) {bg(roi) = toScalar(color);}
+
+    // draw at lw x lh and let the X server scale it to the window, Sui only
+    bool setLogicalSize(int lw, int lh, bool smooth = true) {
+        bool ok = true;
+        if (!headless) {
+#if defined(USE_SUI)
+            if (direct) sui_unlock_framebuffer(sui);
+            ok = 0 == sui_set_logical_size(sui, lw, lh, smooth ? SUI_FILTER_BILINEAR : SUI_FILTER_NEAREST);
+            if (!ok) sui_get_size(sui, &lw, &lh); // it may have gone back to the window size
+#else
+            return false;
+#endif
+        }
+        const bool resized = ok || lw != width || lh != height;
+        if (resized) {
+            width  = lw;
+            height = lh;
+            bg = Mat(Size(lw, lh), CV_8UC3, toScalar(color));
+        }
+#if defined(USE_SUI)
+        if (direct && (direct = lockFramebuffer()) && resized) bg = toScalar(color);
+#endif
+        if (resized) invalidate();
+        return ok;
+    }
+
+    void clear() {bg = toScalar(color); invalidate();}
+    void clear(const Rect &roi) {bg(roi) = toScalar(color); invalidate(roi);}
+    
+    // record all input and the keys returned by show, NULL to stop
+    void record(InputRecorder *recorder) {this->recorder = recorder;}
+    // take input from a recorded session instead of waiting for it, NULL to stop
+    void replay(InputReplayer *replayer) {this->replayer = replayer;}
     
     int show(int ms = 20) {
+        const uint64_t start = nowUs();
+        if (lastShown) frameTime = (start - lastShown) * 0.001;
+        present();
+        int key;
+        if (replayer) {
+            // the window still has to repaint, mouseCallback drops its input meanwhile
+            if (!headless) wait(1); // 0 would block until a key in both backends
+            key = replayer->play(this);
+        }
+        else key = wait(ms);
+        if (key >= 0) input.push(KEY_EVENT, key, 0, 0);
+        if (recorder) recorder->endFrame(key);
+        hits.build(bg.cols, bg.rows);
+        hotX = hotY = INT_MIN;
+        key = dispatch();
+        lastKey = key;
+        lastShown = nowUs();
+        return key;
+    }
+
+    // go through all input since the last frame in batches, the clicks go to 
+    // the widgets under them, return the oldest key not returned yet; keys that 
+    // came in the same frame are returned by the next ones
+    int dispatch() {
+        InputEvent batch[64];
+        size_t n;
+        for (size_t i = 0; i < clicks.size(); ) { // unclaimed for a whole frame
+            if (clicks[i].age++ > 0) {
+                clicks[i] = clicks.back();
+                clicks.pop_back();
+            }
+            else ++i;
+        }
+        while ((n = input.take(batch, 64)) > 0) {
+            for (size_t i = 0; i < n; ++i) {
+                const InputEvent &e = batch[i];
+                if (e.type == KEY_EVENT) {
+                    if (pendingKeys.size() < MAX_PENDING_KEYS) pendingKeys.push_back(e.x);
+                }
+                else if (e.type == cv::EVENT_LBUTTONDOWN) pointerDown = true;
+                else if (e.type == cv::EVENT_LBUTTONUP && pointerDown) {
+                    Click c;
+                    c.id = hits.find(e.x, e.y);
+                    c.age = 0;
+                    if (c.id) clicks.push_back(c);
+                    pointerDown = false;
+                }
+            }
+        }
+        return nextKey();
+    }
+    
+    // the next key show() hasn't returned yet, -1 when there's none; to take 
+    // all the keys of a frame at once
+    int nextKey() {
+        if (pendingKeys.empty()) return -1;
+        const int key = pendingKeys.front();
+        pendingKeys.pop_front();
+        return key;
+    }
+    
+    // true once for each click widget id got
+    bool takeClick(const void *id) {
+        for (size_t i = 0; i < clicks.size(); ++i) {
+            if (clicks[i].id == id) {
+                clicks.erase(clicks.begin() + i);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // the topmost widget under the pointer in the last frame's layout
+    const void *hotId() {
+        if (mouse.x != hotX || mouse.y != hotY) {
+            hot = hits.find(mouse.x, mouse.y);
+            hotX = mouse.x;
+            hotY = mouse.y;
+        }
+        return hot;
+    }
+
+    // send the changed regions of bg to the window without waiting for events,
+    // nothing is sent when no widget repainted
+    void present() {
+        if (headless || damage.empty()) {
+            damage.clear();
+            return;
+        }
 #if defined(USE_SUI)
-        sui_show(sui, bg.data, bg.cols, bg.rows, bg.step, bg.channels());
-        return sui_wait(sui, ms);
+        sui_rect rects[MAX_DAMAGE];
+        const int n = (int)damage.size();
+        for (int i = 0; i < n; ++i) {
+            rects[i].x = damage[i].x; rects[i].y = damage[i].y;
+            rects[i].w = damage[i].width; rects[i].h = damage[i].height;
+        }
+        if (direct) sui_unlock_framebuffer(sui);
+        sui_show_rects(sui, bg.data, bg.cols, bg.rows, bg.step, bg.channels(), rects, n);
+        if (direct) lockFramebuffer(); // widgets could draw again once the server read it
 #else
         cv::imshow(wname, bg);
+#endif
+        damage.clear();
+    }
+
+    // handle events for ms, with a shared context all its screens are served 
+    int wait(int ms = 20) {
+        if (headless) { // never sleeps, returns the fed keys one by one
+            if (keys.empty()) return -1;
+            const int key = keys.front();
+            keys.pop_front();
+            return key;
+        }
+#if defined(USE_SUI)
+        return sui_wait(sui, ms);
+#else
         return cv::waitKey(ms);
 #endif
     }
 
 #if defined(USE_SUI)
+    // let Sui's own thread present, show() only hands over the frame, not with direct
+    bool presentInBackground(bool on) {
+        if (direct || headless) return false;
+        return 0 == (on ? sui_start_presenter(sui) : sui_stop_presenter(sui));
+    }
+    
+    // wrap Sui's BGRX framebuffer as bg, the memory is owned by sui 
+    bool lockFramebuffer() {
+        unsigned char *data = NULL;
+        int w, h, ws, format;
+        if (0 != sui_lock_framebuffer(sui, &data, &w, &h, &ws, &format)) return false;
+        if (format != SUI_FORMAT_BGRX) {
+            sui_unlock_framebuffer(sui);
+            return false;
+        }
+        if (bg.data != data || bg.cols != w || bg.rows != h || bg.type() != CV_8UC4) {
+            bg = Mat(h, w, CV_8UC4, data, ws);
+        }
+        return true;
+    }
+    
     Sui *sui;
 #else
     string wname;
 #endif 
+    enum {MAX_DAMAGE = 16, MAX_PENDING_KEYS = 64};
+    
     Mat bg;
+    std::vector<Rect> damage; // changed since the last present()
     int width, height;
     int color;        
+    bool direct;
+    bool headless;
+    std::deque<int> keys;        // fed to a headless screen
+    std::deque<int> pendingKeys; // dispatched, not returned by show() yet
+    InputReplayer *replayer;
+    double frameTime; // ms spent between the last two show(), without waiting
+    uint64_t lastShown;
+    int lastKey;      // returned by the last show()
+    HitGrid hits;     // widgets registered by mouseStatus
+    const void *hot;
+    int hotX, hotY;
+    struct Click {const void *id; int age;};
+    std::vector<Click> clicks; // from the queued input, not claimed yet
+    bool pointerDown;
+    Mouse mouse;      // the input of this screen only, it may run on its own thread
+    InputQueue input;
+    InputRecorder *recorder;
 };
 
+static void
+screenInput(int e, int x, int y, int flags, void *p) {
+    Screen *screen = (Screen *)p;
+    if (screen->recorder) screen->recorder->put(e, x, y, flags);
+    screen->input.push(e, x, y, flags);
+    screen->mouse.update(e, x, y);
+}
+
+// input of the window, ignored while a session is replayed so it can't interfere 
+static void
+mouseCallback(int e, int x, int y, int flags, void *p) {
+    if (((Screen *)p)->replayer) return;
+    screenInput(e, x, y, flags, p);
+}
+
+// status of widget id in roi, clicks come from the queued input, else only the 
+// topmost widget under the pointer is tested; custom widgets use it too, with 
+// any pointer that stays the same between frames as id
+static int
+mouseStatus(Screen &screen, const void *id, const Rect &r, uint mask = (uint)(-1), int defaultV = IDLE) {
+    int s = IDLE;
+    screen.hits.add(id, r);
+    if (screen.takeClick(id)) s = CLICKED;
+    else if (id == screen.hotId() && screen.mouse.isInside(r)) s = screen.mouse.pressed ? PRESSED : HOVERED;
+    s = s & mask;
+    return s == 0 ? defaultV : s;
+}
+
+// mouseStatus of a widget that may be disabled, which still covers what's under it
+static int
+widgetStatus(Screen &screen, const void *id, const Rect &r, bool disabled, uint mask = (uint)(-1)) {
+    if (!disabled) return mouseStatus(screen, id, r, mask);
+    screen.hits.add(id, r);
+    screen.takeClick(id);
+    return DISABLED;
+}
+
+// FNV-1a over what a widget shows, so it repaints when that changes without redraw()
+static uint64_t
+contentHash(const void *data, size_t n, uint64_t h = 14695981039346656037ULL) {
+    const uint8_t *p = (const uint8_t *)data;
+    for (size_t i = 0; i < n; ++i) h = (h ^ p[i]) * 1099511628211ULL;
+    return h;
+}
+
+static uint64_t
+contentHash(const string &text) {
+    const uint64_t n = text.size();
+    return contentHash(text.data(), text.size(), contentHash(&n, sizeof(n)));
+}
+
 struct Button
 {
     Button() {
@@ -256,6 +1266,9 @@ struct Button
         status   = INIT;
         align    = ALIGN_CENTER;
         disabled = false; // disable the component 
+        cached   = false;
+        cache    = NULL;
+        content  = 0;
     }
 
     void reset() {status = INIT; disabled = false;}
@@ -264,18 +1277,38 @@ struct Button
     
     int operator()(Screen &screen, const string &text, int x, int y, int w, int h) {
         const Rect roi(x,y,w,h);
-        const int s = disabled ? DISABLED : mouseStatus(roi);
-        if (s != status) {
+        const int s = widgetStatus(screen, this, roi, disabled);
+        const uint64_t fp = contentHash(text);
+        if (s != status || fp != content) {
             status = s;
+            content = fp;
             area = screen.bg(roi);
-            area = getBgColor(s);
-            font.putText(area, text, s == DISABLED, align);
+            screen.invalidate(roi);
+            paint(text, s);
         }
         
         return status;
     }
 
+    void paint(const string &text, const int s) {
+        BitmapCache *cache = widgetCache(cached, this->cache);
+        string key;
+        if (cache) {
+            char head[64];
+            snprintf(head, sizeof(head), "B%dx%d %d %d %x %d|", area.cols, area.rows, area.type(), s, getBgValue(s), align);
+            key = head + font.fingerprint() + text;
+            if (blitCached(cache, key, area)) return;
+        }
+        area = getBgColor(s);
+        font.putText(area, text, s == DISABLED, align, getBgValue(s));
+        storeCached(cache, key, area);
+    }
+
     Scalar getBgColor(const int s) {
+        return toScalar(getBgValue(s));
+    }
+    
+    uint getBgValue(const int s) {
         uint c = color;
         switch(s) {
         case DISABLED: c = color_disabled; break;
@@ -285,7 +1318,7 @@ struct Button
         case CLICKED:  c = color_clicked; break;
         default: ASSERT(0); break;
         }
-        return toScalar(c);
+        return c;
     }
     
     Font font;
@@ -298,6 +1331,9 @@ struct Button
     int status;
     int align;
     bool disabled;    
+    bool cached;        // keep pre-rendered states, false to always draw
+    BitmapCache *cache; // NULL for the shared stateCache()
+    uint64_t content;   // contentHash of what was drawn
     Mat area;
 };
 
@@ -309,23 +1345,226 @@ struct Label : Button
     
     int operator()(Screen &screen, const string &text, int x, int y, int w, int h) {
         const Rect roi(x,y,w,h);
-        const int s = disabled ? DISABLED : mouseStatus(roi, IDLE | CLICKED);
-        if (s != status) {
+        const int s = widgetStatus(screen, this, roi, disabled, IDLE | CLICKED);
+        const uint64_t fp = contentHash(text);
+        if (s != status || fp != content) {
             status = s;
+            content = fp;
             area = screen.bg(roi);
-            area = getBgColor(s);
-            font.putText(area, text, s == DISABLED, align);
+            screen.invalidate(roi);
+            paint(text, s);
         }
         return status;
     }
 };
 
+static int
+cvtCode(int srcChannels, int dstChannels) {
+    switch(srcChannels * 10 + dstChannels) {
+    case 13: return cv::COLOR_GRAY2BGR;
+    case 14: return cv::COLOR_GRAY2BGRA;
+    case 31: return cv::COLOR_BGR2GRAY;
+    case 34: return cv::COLOR_BGR2BGRA;
+    case 41: return cv::COLOR_BGRA2GRAY;
+    case 43: return cv::COLOR_BGRA2BGR;
+    default: ASSERT(0); break;
+    }
+    return -1;
+}
+
+/*
+ * Fused resize + gray to BGR/BGRA for copyTo, one pass into the area. The 
+ * coordinate tables depend only on the sizes, they are kept until those change.
+ * Bilinear follows cv::resize's fixed point scheme, area averages the source
+ * pixels whose top left corner falls in the box (exact for whole factors).
+ */
+struct ResizeTables
+{
+    ResizeTables() {sw = sh = dw = dh = interp = -1; area = false;}
+    
+    void build(int sw, int sh, int dw, int dh, int interp) {
+        if (sw == this->sw && sh == this->sh && dw == this->dw && dh == this->dh && interp == this->interp) return;
+        this->sw = sw; this->sh = sh; this->dw = dw; this->dh = dh; this->interp = interp;
+        area = interp == cv::INTER_AREA && sw > dw && sh > dh; // else bilinear as cv::resize
+        axis(sw, dw, xofs, xend, xalpha);
+        axis(sh, dh, yofs, yend, ybeta);
+    }
+    
+    int sw, sh, dw, dh, interp;
+    bool area;
+    std::vector<int> xofs, xend, yofs, yend; // xend/yend: area only
+    std::vector<short> xalpha, ybeta;        // bilinear weights of the second pixel, out of 2048
+    
+private:
+    void axis(int s, int d, std::vector<int> &ofs, std::vector<int> &end, std::vector<short> &w) {
+        const double scale = (double)s / d;
+        ofs.resize(d); end.resize(d); w.resize(d);
+        for (int i = 0; i < d; ++i) {
+            if (interp == cv::INTER_NEAREST) {
+                ofs[i] = std::min((int)floor(i * scale), s - 1);
+            }
+            else if (area) {
+                ofs[i] = (int)((int64_t)i * s / d);
+                end[i] = std::max(ofs[i] + 1, (int)((int64_t)(i + 1) * s / d));
+            }
+            else {
+                double f = (i + 0.5) * scale - 0.5;
+                int o = (int)floor(f);
+                f -= o;
+                if (o < 0) {o = 0; f = 0;}
+                if (o >= s - 1) {o = s - 1; f = 0;}
+                ofs[i] = o;
+                w[i] = (short)cvRound(f * 2048);
+            }
+        }
+    }
+};
+
+// gray to 3 (BGR) or 4 (BGRA, alpha 255) channels
+static void
+expandGray(const uint8_t *g, uint8_t *d, int n, int cn) {
+    int i = 0;
+    if (cn == 4) {
+#if defined(__SSE2__)
+        const __m128i ff = _mm_set1_epi8((char)0xFF);
+        for (; i + 16 <= n; i += 16) {
+            const __m128i v = _mm_loadu_si128((const __m128i *)(g + i));
+            const __m128i gg0 = _mm_unpacklo_epi8(v, v), gg1 = _mm_unpackhi_epi8(v, v);
+            const __m128i ga0 = _mm_unpacklo_epi8(v, ff), ga1 = _mm_unpackhi_epi8(v, ff);
+            _mm_storeu_si128((__m128i *)(d + 4*i),      _mm_unpacklo_epi16(gg0, ga0));
+            _mm_storeu_si128((__m128i *)(d + 4*i + 16), _mm_unpackhi_epi16(gg0, ga0));
+            _mm_storeu_si128((__m128i *)(d + 4*i + 32), _mm_unpacklo_epi16(gg1, ga1));
+            _mm_storeu_si128((__m128i *)(d + 4*i + 48), _mm_unpackhi_epi16(gg1, ga1));
+        }
+#endif
+        for (; i < n; ++i) {
+            d[4*i] = d[4*i+1] = d[4*i+2] = g[i];
+            d[4*i+3] = 0xFF;
+        }
+        return;
+    }
+#if defined(__SSSE3__)
+    const __m128i m0 = _mm_setr_epi8(0,0,0,1,1,1,2,2,2,3,3,3,4,4,4,5);
+    const __m128i m1 = _mm_setr_epi8(5,5,6,6,6,7,7,7,8,8,8,9,9,9,10,10);
+    const __m128i m2 = _mm_setr_epi8(10,11,11,11,12,12,12,13,13,13,14,14,14,15,15,15);
+    for (; i + 16 <= n; i += 16) {
+        const __m128i v = _mm_loadu_si128((const __m128i *)(g + i));
+        _mm_storeu_si128((__m128i *)(d + 3*i),      _mm_shuffle_epi8(v, m0));
+        _mm_storeu_si128((__m128i *)(d + 3*i + 16), _mm_shuffle_epi8(v, m1));
+        _mm_storeu_si128((__m128i *)(d + 3*i + 32), _mm_shuffle_epi8(v, m2));
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 16 <= n; i += 16) {
+        const uint8x16_t v = vld1q_u8(g + i);
+        uint8x16x3_t t;
+        t.val[0] = t.val[1] = t.val[2] = v;
+        vst3q_u8(d + 3*i, t);
+    }
+#endif
+    for (; i < n; ++i) d[3*i] = d[3*i+1] = d[3*i+2] = g[i];
+}
+
+// horizontal bilinear pass of one source row, 2048 scaled and shifted down by 4 as cv::resize
+static void
+resizeRowH(const uint8_t *s, short *h, const ResizeTables &t) {
+    for (int x = 0; x < t.dw; ++x) {
+        const int o = t.xofs[x], a = t.xalpha[x];
+        const int s1 = s[std::min(o + 1, t.sw - 1)];
+        h[x] = (short)((s[o] * (2048 - a) + s1 * a) >> 4);
+    }
+}
+
+// rows [y0, y1) of dst (cn channels) from the gray src
+static void
+resizeGrayRows(const uint8_t *src, size_t sstep, uint8_t *dst, size_t dstep, int cn, const ResizeTables &t, int y0, int y1) {
+    std::vector<uint8_t> row(t.dw);
+    std::vector<short> h0, h1;
+    std::vector<uint32_t> sums;
+    int r0 = -1, r1 = -1; // source rows in h0, h1
+    if (t.area) sums.resize(t.sw);
+    else if (t.interp != cv::INTER_NEAREST) {h0.resize(t.dw); h1.resize(t.dw);}
+    
+    for (int y = y0; y < y1; ++y) {
+        uint8_t *out = &row[0];
+        if (t.interp == cv::INTER_NEAREST) {
+            const uint8_t *s = src + t.yofs[y] * sstep;
+            for (int x = 0; x < t.dw; ++x) out[x] = s[t.xofs[x]];
+        }
+        else if (t.area) {
+            const int ya = (int)((int64_t)y * t.sh / t.dh);
+            const int yb = std::max(ya + 1, (int)((int64_t)(y + 1) * t.sh / t.dh));
+            std::fill(sums.begin(), sums.end(), 0);
+            for (int sy = ya; sy < yb; ++sy) {
+                const uint8_t *s = src + sy * sstep;
+                for (int x = 0; x < t.sw; ++x) sums[x] += s[x];
+            }
+            for (int x = 0; x < t.dw; ++x) {
+                uint32_t sum = 0;
+                for (int sx = t.xofs[x]; sx < t.xend[x]; ++sx) sum += sums[sx];
+                const uint32_t n = (uint32_t)(t.xend[x] - t.xofs[x]) * (yb - ya);
+                out[x] = (uint8_t)((sum + n / 2) / n);
+            }
+        }
+        else { // bilinear, neighbouring rows share their horizontal pass
+            const int sy0 = t.yofs[y], sy1 = std::min(sy0 + 1, t.sh - 1);
+            if (sy0 == r1) {h0.swap(h1); r0 = r1; r1 = -1;}
+            if (sy0 != r0) {resizeRowH(src + sy0 * sstep, &h0[0], t); r0 = sy0;}
+            if (sy1 != r1) {resizeRowH(src + sy1 * sstep, &h1[0], t); r1 = sy1;}
+            const short b1 = t.ybeta[y], b0 = 2048 - b1;
+            int x = 0;
+#if defined(__SSE2__)
+            const __m128i vb0 = _mm_set1_epi16(b0), vb1 = _mm_set1_epi16(b1), two = _mm_set1_epi16(2);
+            for (; x + 16 <= t.dw; x += 16) {
+                __m128i r[2];
+                for (int k = 0; k < 2; ++k) {
+                    const __m128i a = _mm_loadu_si128((const __m128i *)(&h0[x + 8*k]));
+                    const __m128i b = _mm_loadu_si128((const __m128i *)(&h1[x + 8*k]));
+                    const __m128i v = _mm_add_epi16(_mm_mulhi_epi16(a, vb0), _mm_mulhi_epi16(b, vb1));
+                    r[k] = _mm_srai_epi16(_mm_add_epi16(v, two), 2);
+                }
+                _mm_storeu_si128((__m128i *)(out + x), _mm_packus_epi16(r[0], r[1]));
+            }
+#endif
+            for (; x < t.dw; ++x) {
+                const int v = ((b0 * h0[x]) >> 16) + ((b1 * h1[x]) >> 16);
+                out[x] = (uint8_t)std::min(255, (v + 2) >> 2);
+            }
+        }
+        expandGray(out, dst + y * dstep, t.dw, cn);
+    }
+}
+
+struct ResizeGrayBody : cv::ParallelLoopBody
+{
+    ResizeGrayBody(const Mat &src, Mat &dst, const ResizeTables &t) : src(src), dst(dst), t(t) {}
+    void operator()(const cv::Range &r) const {
+        resizeGrayRows(src.ptr(0), src.step, dst.ptr(0), dst.step, dst.channels(), t, r.start, r.end);
+    }
+    const Mat &src;
+    Mat &dst;
+    const ResizeTables &t;
+};
+
+// gray src resized into the BGR/BGRA dst as it is, rows split over threads with parallel
+static void
+resizeGray(const Mat &src, Mat &dst, int interp = cv::INTER_LINEAR, bool parallel = false) {
+    static thread_local ResizeTables tables;
+    ASSERT(src.type() == CV_8UC1 && (dst.type() == CV_8UC3 || dst.type() == CV_8UC4));
+    tables.build(src.cols, src.rows, dst.cols, dst.rows, interp);
+    if (parallel) {
+        cv::parallel_for_(cv::Range(0, dst.rows), ResizeGrayBody(src, dst, tables));
+    }
+    else {
+        resizeGrayRows(src.ptr(0), src.step, dst.ptr(0), dst.step, dst.channels(), tables, 0, dst.rows);
+    }
+}
+
 static void
 copyTo(const Mat &img, Mat &area, Mat *buff = NULL) {
     const int imgType = img.type(), areaType = area.type();
     const Size imgSize = img.size(), areaSize = area.size();
     
-    ASSERT(imgType == CV_8UC1 || imgType == CV_8UC3);
+    ASSERT(imgType == CV_8UC1 || imgType == CV_8UC3 || imgType == CV_8UC4);
     
     if (imgType == areaType && imgSize == areaSize) {
         img.copyTo(area);
@@ -334,17 +1573,21 @@ copyTo(const Mat &img, Mat &area, Mat *buff = NULL) {
         cv::resize(img, area, areaSize);
     }
     else if (imgSize == areaSize) { // type not the same 
-        cv::cvtColor(img, area, cv::COLOR_GRAY2BGR);
+        cv::cvtColor(img, area, cvtCode(img.channels(), area.channels()));
+    }
+    else if (imgType == CV_8UC1) { // e.g. mono cameras, one pass without a temporary
+        resizeGray(img, area, cv::INTER_LINEAR, area.total() >= (1 << 18));
     }
     else {
+        const int code = cvtCode(img.channels(), area.channels());
         if (buff) {
             cv::resize(img, *buff, areaSize);
-            cv::cvtColor(*buff, area, cv::COLOR_GRAY2BGR);
+            cv::cvtColor(*buff, area, code);
         }
         else {
             Mat tmp;
             cv::resize(img, tmp, areaSize);
-            cv::cvtColor(tmp, area, cv::COLOR_GRAY2BGR);
+            cv::cvtColor(tmp, area, code);
         }
     }
 }
@@ -366,18 +1609,25 @@ struct ImageLabel
         status = INIT;
         disabled = false;
         color = 0x202020;
+        content = 0;
     }
 
     void reset() {status = INIT; disabled = false;}
     void disable(bool v){disabled = v;}
     void redraw() {status = CHANGED;}
         
-    int operator()(Screen &screen, const Mat &img, int x, int y, int w, int h) {
+    // bump version when the pixels of img change in place 
+    int operator()(Screen &screen, const Mat &img, int x, int y, int w, int h, uint64_t version = 0) {
         const Rect roi(x,y,w,h);
-        const int s = disabled ? DISABLED : mouseStatus(roi, IDLE);
-        if (s != status) {
+        const int s = widgetStatus(screen, this, roi, disabled, IDLE);
+        const uintptr_t data = (uintptr_t)img.data;
+        const int shape[3] = {img.rows, img.cols, img.type()};
+        const uint64_t fp = contentHash(&version, sizeof(version), contentHash(shape, sizeof(shape), contentHash(&data, sizeof(data))));
+        if (s != status || fp != content) {
             status = s; 
+            content = fp;
             area = screen.bg(roi);
+            screen.invalidate(roi);
             if (img.empty()) area = toScalar(color);
             else copyTo(img, area, &buff);
         }
@@ -387,9 +1637,403 @@ struct ImageLabel
     int status;
     bool disabled;    
     uint color;
+    uint64_t content;
     Mat area, buff;
 };
 
+/*
+ * ImageLabel for streams. A capture/inference thread push()es frames, they are
+ * scaled and converted there into one of three buffers preallocated at the 
+ * display size, and the UI thread only takes the newest one and copies it. 
+ * Frames that come faster than the UI repaints are dropped, not queued.
+ */
+struct VideoLabel
+{
+    VideoLabel() : middle(1) {
+        status = INIT;
+        disabled = false;
+        color = 0x202020;
+        back = 0; front = 2;
+        pushed = 0; shown = 0;
+    }
+
+    // size of the label on screen, before the producer starts
+    void init(const Screen &screen, int w, int h) {
+        for (int i = 0; i < 3; ++i) slots[i] = Mat(Size(w, h), screen.bg.type(), toScalar(color));
+        back = 0; front = 2;
+        middle.store(1);
+        status = INIT;
+    }
+    
+    void reset() {status = INIT; disabled = false;}
+    void disable(bool v){disabled = v;}
+    void redraw() {status = CHANGED;}
+    
+    // from the producer thread, false before init()
+    bool push(const Mat &frame) {
+        if (slots[0].empty() || frame.empty()) return false;
+        copyTo(frame, slots[back], &scratch);
+        back = middle.exchange(back | FRESH) & ~FRESH;
+        pushed.fetch_add(1);
+        return true;
+    }
+    
+    int operator()(Screen &screen, int x, int y, int w, int h) {
+        const Rect roi(x,y,w,h);
+        const int s = widgetStatus(screen, this, roi, disabled, IDLE);
+        const bool fresh = (middle.load() & FRESH) != 0;
+        if (fresh) { // the newest frame becomes ours, our old one goes back to the producer
+            front = middle.exchange(front) & ~FRESH;
+            shown.fetch_add(1);
+        }
+        if (s != status || fresh) {
+            status = s;
+            area = screen.bg(roi);
+            screen.invalidate(roi);
+            const Mat &frame = slots[front];
+            if (frame.size() == area.size() && frame.type() == area.type()) frame.copyTo(area);
+            else area = toScalar(color);
+        }
+        return status;
+    }
+    
+    // frames pushed but never shown
+    uint64_t dropped() const {return pushed.load() - shown.load();}
+
+    int status;
+    bool disabled;    
+    uint color;
+    Mat area;
+    
+private:
+    enum {FRESH = 4};
+    
+    Mat slots[3];
+    Mat scratch;             // producer side
+    int back, front;         // owned by the producer, the UI thread
+    std::atomic<int> middle; // the slot in between, FRESH when not taken yet
+    std::atomic<uint64_t> pushed, shown;
+};
+
+/*
+ * Scrolling plot of one or more series. Samples go into a ring of columns, 
+ * each column aggregates decimate samples (min, max, last). A repaint shifts 
+ * the pixels already drawn left and rasterizes only the new columns, so the 
+ * cost per frame depends on the new samples, not on the history. The range 
+ * grows as soon as a sample falls out of it and shrinks after a scan done 
+ * once per capacity columns.
+ */
+struct Plot
+{
+    Plot(int capacity = 1024) {
+        this->capacity = capacity;
+        status = INIT;
+        disabled = false;
+        color = 0x16181D;
+        decimate = 1;
+        autoRange = true;
+        minv = 0; maxv = 1;
+        columns = drawn = scanned = 0;
+        partial = 0;
+        rangeChanged = true;
+    }
+    
+    // returns the index of the series, -1 once samples were pushed (they'd have no value for it)
+    int addSeries(uint color) {
+        if (columns > 0 || partial > 0) return -1;
+        Series sr;
+        sr.color = color;
+        sr.lo.resize(capacity); sr.hi.resize(capacity); sr.last.resize(capacity);
+        sr.plo = sr.phi = sr.plast = 0;
+        series.push_back(sr);
+        return (int)series.size() - 1;
+    }
+    
+    void reset() {status = INIT; disabled = false;}
+    void disable(bool v){disabled = v;}
+    void redraw() {status = CHANGED;}
+    
+    // fixed range, turns auto range off
+    void setRange(float minv, float maxv) {
+        this->minv = minv; this->maxv = maxv;
+        autoRange = false;
+        rangeChanged = true;
+    }
+    
+    // one sample of every series, all advance together
+    void push(const float *values) {
+        for (size_t i = 0; i < series.size(); ++i) {
+            Series &sr = series[i];
+            const float v = values[i];
+            if (partial == 0) sr.plo = sr.phi = v;
+            else {sr.plo = std::min(sr.plo, v); sr.phi = std::max(sr.phi, v);}
+            sr.plast = v;
+        }
+        if (++partial < decimate) return;
+        
+        const int c = (int)(columns % capacity);
+        float lo = FLT_MAX, hi = -FLT_MAX;
+        for (size_t i = 0; i < series.size(); ++i) {
+            Series &sr = series[i];
+            sr.lo[c] = sr.plo; sr.hi[c] = sr.phi; sr.last[c] = sr.plast;
+            lo = std::min(lo, sr.plo);
+            hi = std::max(hi, sr.phi);
+        }
+        if (autoRange && !series.empty() && (columns == 0 || lo < minv || hi > maxv)) grow(lo, hi);
+        partial = 0;
+        ++columns;
+    }
+    
+    // the single series only
+    void push(float v) {
+        ASSERT(series.size() == 1);
+        push(&v);
+    }
+    
+    int operator()(Screen &screen, int x, int y, int w, int h) {
+        const Rect roi(x,y,w,h);
+        const int s = widgetStatus(screen, this, roi, disabled, IDLE);
+        if (autoRange && columns - scanned >= (uint64_t)capacity) shrink();
+        
+        const uint64_t fresh = columns - drawn;
+        // columns already overwritten in the ring can't be drawn incrementally
+        const bool full = s != status || roi != lastRoi || rangeChanged || fresh >= (uint64_t)std::min(w, capacity);
+        if (!full && fresh == 0) return status;
+        
+        status = s;
+        lastRoi = roi;
+        rangeChanged = false;
+        area = screen.bg(roi);
+        screen.invalidate(roi);
+        
+        const uint64_t visible = std::min<uint64_t>(columns, (uint64_t)std::min(w, capacity));
+        uint64_t from = columns - visible;
+        if (full) area = toScalar(color);
+        else { // move what's drawn to the left, only the new columns are rasterized
+            from = std::max(columns - fresh, columns - std::min<uint64_t>(columns, capacity));
+            const int cn = area.channels(), shift = (int)fresh * cn;
+            for (int r = 0; r < h; ++r) {
+                uint8_t *row = area.ptr(r);
+                memmove(row, row + shift, (w * cn) - shift);
+            }
+            area(Rect(w - (int)fresh, 0, (int)fresh, h)) = toScalar(color);
+        }
+        for (uint64_t i = from; i < columns; ++i) drawColumn(i, w - (int)(columns - i));
+        drawn = columns;
+        return status;
+    }
+
+    int status;
+    bool disabled;
+    uint color;       // background
+    int decimate;     // samples per column
+    bool autoRange;
+    float minv, maxv;
+    Mat area;
+    
+private:
+    struct Series
+    {
+        uint color;
+        std::vector<float> lo, hi, last; // ring of columns
+        float plo, phi, plast;           // the column being filled
+    };
+    
+    int toY(float v) const {
+        const int h = area.rows;
+        const float span = maxv > minv ? maxv - minv : 1.f;
+        const int y = (h - 1) - cvRound((v - minv) * (h - 1) / span);
+        return std::max(0, std::min(h - 1, y));
+    }
+    
+    // span of column i at px, joined to the previous column if it's still kept 
+    void drawColumn(uint64_t i, int px) {
+        const int c = (int)(i % capacity), cn = area.channels();
+        for (size_t k = 0; k < series.size(); ++k) {
+            const Series &sr = series[k];
+            float lo = sr.lo[c], hi = sr.hi[c];
+            if (i > 0 && columns - i < (uint64_t)capacity) {
+                const float prev = sr.last[(i - 1) % capacity];
+                lo = std::min(lo, prev);
+                hi = std::max(hi, prev);
+            }
+            const Scalar sc = toScalar(sr.color);
+            for (int y = toY(hi), y1 = toY(lo); y <= y1; ++y) {
+                uint8_t *p = area.ptr(y) + px * cn;
+                for (int j = 0; j < cn; ++j) p[j] = (uint8_t)sc[j];
+            }
+        }
+    }
+    
+    static float margin(float lo, float hi) {
+        return (hi - lo) * 0.1f + 1e-3f * (fabsf(hi) + 1.f);
+    }
+    
+    void grow(float lo, float hi) {
+        if (columns == 0) {
+            minv = lo - margin(lo, hi);
+            maxv = hi + margin(lo, hi);
+        }
+        else {
+            const float m = margin(std::min(lo, minv), std::max(hi, maxv));
+            if (lo < minv) minv = lo - m;
+            if (hi > maxv) maxv = hi + m;
+        }
+        rangeChanged = true;
+    }
+    
+    // fit the range again when the data only uses a small part of it
+    void shrink() {
+        scanned = columns;
+        const uint64_t n = std::min<uint64_t>(columns, (uint64_t)capacity);
+        float lo = maxv, hi = minv;
+        for (uint64_t i = columns - n; i < columns; ++i) {
+            for (size_t k = 0; k < series.size(); ++k) {
+                lo = std::min(lo, series[k].lo[i % capacity]);
+                hi = std::max(hi, series[k].hi[i % capacity]);
+            }
+        }
+        const float m = margin(lo, hi);
+        if (hi >= lo && (hi - lo + 2 * m) < 0.5f * (maxv - minv)) {
+            minv = lo - m;
+            maxv = hi + m;
+            rangeChanged = true;
+        }
+    }
+    
+    int capacity;     // columns kept
+    std::vector<Series> series;
+    uint64_t columns, drawn, scanned;
+    int partial;      // samples in the column being filled
+    bool rangeChanged;
+    Rect lastRoi;
+};
+
+/*
+ * 256 bin histograms of each channel (at most 3) of an 8 bit image, over roi 
+ * (all of img when empty) and every step-th row and column. Neighbouring
+ * pixels count into separate accumulators, so increments of the same bin 
+ * don't wait on each other; they are summed at the end. Returns the number 
+ * of pixels counted.
+ */
+static uint32_t
+calcHistogram(const Mat &img, uint32_t hist[3][256], int step = 1, Rect roi = Rect()) {
+    const int cn = img.channels(), hc = std::min(cn, 3);
+    uint32_t acc[4][3][256];
+    uint32_t count = 0;
+    ASSERT(img.depth() == CV_8U && step >= 1);
+    if (roi.area() <= 0) roi = Rect(0, 0, img.cols, img.rows);
+    roi &= Rect(0, 0, img.cols, img.rows);
+    memset(acc, 0, sizeof(acc));
+    
+    for (int y = roi.y; y < roi.y + roi.height; y += step) {
+        const uint8_t *p = img.ptr(y) + roi.x * cn;
+        const int n = (roi.width + step - 1) / step, ps = step * cn;
+        int i = 0;
+        if (hc == 1) {
+            for (; i + 4 <= n; i += 4, p += 4 * ps) {
+                ++acc[0][0][p[0]]; ++acc[1][0][p[ps]]; ++acc[2][0][p[2*ps]]; ++acc[3][0][p[3*ps]];
+            }
+        }
+        else if (hc == 3) {
+            for (; i + 2 <= n; i += 2, p += 2 * ps) {
+                ++acc[0][0][p[0]];  ++acc[0][1][p[1]];    ++acc[0][2][p[2]];
+                ++acc[1][0][p[ps]]; ++acc[1][1][p[ps+1]]; ++acc[1][2][p[ps+2]];
+            }
+        }
+        for (; i < n; ++i, p += ps) {
+            for (int c = 0; c < hc; ++c) ++acc[2][c][p[c]]; // all of a 2 channel image
+        }
+        count += n;
+    }
+    
+    for (int c = 0; c < hc; ++c) {
+        for (int b = 0; b < 256; ++b) hist[c][b] = acc[0][c][b] + acc[1][c][b] + acc[2][c][b] + acc[3][c][b];
+    }
+    return count;
+}
+
+/*
+ * Live histogram of an image, the bars of each channel are drawn straight into
+ * area (gray, or blue/green/red mixing where they overlap). It only repaints
+ * when the bins moved by more than threshold of the counted pixels.
+ */
+struct Histogram
+{
+    Histogram() {
+        status = INIT;
+        disabled = false;
+        color = 0x16181D;
+        step = 2;
+        logScale = false;
+        threshold = 0.01f;
+        channels = 0;
+        memset(bins, 0, sizeof(bins));
+    }
+    
+    void reset() {status = INIT; disabled = false;}
+    void disable(bool v){disabled = v;}
+    void redraw() {status = CHANGED;}
+    
+    // roi of img to count, all of it when empty
+    int operator()(Screen &screen, const Mat &img, int x, int y, int w, int h, const Rect &imgRoi = Rect()) {
+        const Rect roi(x,y,w,h);
+        const int s = widgetStatus(screen, this, roi, disabled, IDLE);
+        uint32_t hist[3][256];
+        const int cn = img.empty() ? 0 : std::min(img.channels(), 3);
+        const uint32_t count = cn ? calcHistogram(img, hist, step, imgRoi) : 0;
+        
+        uint64_t moved = 0;
+        for (int c = 0; c < cn; ++c) {
+            for (int b = 0; b < 256; ++b) moved += hist[c][b] > bins[c][b] ? hist[c][b] - bins[c][b] : bins[c][b] - hist[c][b];
+        }
+        if (s == status && cn == channels && moved <= threshold * count) return status;
+        
+        status = s;
+        channels = cn;
+        memcpy(bins, hist, sizeof(uint32_t) * 256 * cn);
+        area = screen.bg(roi);
+        screen.invalidate(roi);
+        area = toScalar(color);
+        draw();
+        return status;
+    }
+
+    int status;
+    bool disabled;
+    uint color;
+    int step;         // count every step-th row and column
+    bool logScale;
+    float threshold;  // moved bins / counted pixels that make it repaint
+    Mat area;
+    
+private:
+    void draw() {
+        const int w = area.cols, h = area.rows, cn = area.channels();
+        uint32_t top = 1;
+        for (int c = 0; c < channels; ++c) {
+            for (int b = 0; b < 256; ++b) top = std::max(top, bins[c][b]);
+        }
+        const double norm = logScale ? log1p((double)top) : (double)top;
+        for (int x = 0; x < w; ++x) {
+            const int b0 = x * 256 / w, b1 = std::max(b0 + 1, (x + 1) * 256 / w);
+            for (int c = 0; c < channels; ++c) {
+                uint32_t v = 0;
+                for (int b = b0; b < b1; ++b) v = std::max(v, bins[c][b]);
+                const int bar = cvRound((logScale ? log1p((double)v) : (double)v) / norm * h);
+                for (int y = h - bar; y < h; ++y) {
+                    uint8_t *p = area.ptr(y) + x * cn;
+                    if (channels == 1) {for (int j = 0; j < std::min(cn, 3); ++j) p[j] = 0xB0;}
+                    else if (c < cn) p[c] = 0xD0;
+                }
+            }
+        }
+    }
+    
+    uint32_t bins[3][256]; // as drawn
+    int channels;
+};
+
 struct CheckBox
 {
     CheckBox() {
@@ -402,6 +2046,9 @@ struct CheckBox
         outer_size = 1;
         inner_color = 0x2670AF;
         align = ALIGN_LEFT;
+        cached = false;
+        cache = NULL;
+        content = 0;
     }
 
     void reset() {status = INIT; disabled = false;}
@@ -410,23 +2057,39 @@ struct CheckBox
 
     int operator()(Screen &screen, const string &text, bool &isChecked, int x, int y, int w, int h) {
         const Rect roi(x, y, w, h);
-        const int s = disabled ? DISABLED : mouseStatus(roi, IDLE | CLICKED);        
-        if (s != status) {
+        const int s = widgetStatus(screen, this, roi, disabled, IDLE | CLICKED);        
+        const uint64_t fp = contentHash(text);
+        if (s != status || fp != content) {
             status = s; 
+            content = fp;
             if (s == CLICKED) checked = !checked;
             const int boxSize = std::min(w, h) - (1 + outer_size) * 2;
             const Rect outer(1+outer_size, 1+outer_size, boxSize, boxSize);
             const Rect inner(outer.x+3, outer.y+3, outer.width-6, outer.height-6);
             const Rect fontArea(outer.x + outer.width + 3, outer.y, w - outer.width - 4, outer.height);                        
             area = screen.bg(roi);
-            area = toScalar(color);  
-            rectangle(area, outer, s == DISABLED ? color_disabled : outer_color, outer_size);
-            if (checked) fill(area, inner, s == DISABLED ? color_disabled : inner_color);            
-            font.putText(area, fontArea, text, s == DISABLED, align);            
+            screen.invalidate(roi);
+            BitmapCache *cache = widgetCache(cached, this->cache);
+            const string key = cache ? stateKey('C', text, s) : string();
+            if (!blitCached(cache, key, area)) {
+                area = toScalar(color);  
+                rectangle(area, outer, s == DISABLED ? color_disabled : outer_color, outer_size);
+                if (checked) fill(area, inner, s == DISABLED ? color_disabled : inner_color);            
+                font.putText(area, fontArea, text, s == DISABLED, align, color);            
+                storeCached(cache, key, area);
+            }
         }        
         isChecked = checked;
         return status;
     }
+
+    // everything a state of the box is drawn from 
+    string stateKey(char kind, const string &text, int s) const {
+        char head[96];
+        snprintf(head, sizeof(head), "%c%dx%d %d %d %d %x %x %x %x %d %d|", kind, area.cols, area.rows, area.type(), s,
+                 checked, color, color_disabled, outer_color, inner_color, outer_size, align);
+        return head + font.fingerprint() + text;
+    }
         
     bool checked;
     bool disabled;
@@ -439,6 +2102,9 @@ struct CheckBox
     uint inner_color;    
     int outer_size;
     int align;
+    bool cached;        // keep pre-rendered states, false to always draw
+    BitmapCache *cache; // NULL for the shared stateCache()
+    uint64_t content;   // contentHash of what was drawn
     Mat area;
 };
 
@@ -447,9 +2113,11 @@ struct RadioBox : CheckBox
     int operator() (Screen &screen, const string &text, const int uid, int &checkedId, int x, int y, int w, int h) {
         const Rect roi(x,y,w,h);
         const bool cc = checkedId == uid;
-        const int s = disabled ? DISABLED : mouseStatus(roi, IDLE|CLICKED);
-        if (s != status || cc != checked) {
+        const int s = widgetStatus(screen, this, roi, disabled, IDLE|CLICKED);
+        const uint64_t fp = contentHash(text);
+        if (s != status || cc != checked || fp != content) {
             status = s; checked = cc;
+            content = fp;
             if (s == CLICKED) {checkedId = uid;}
             const int boxSize = std::min(w, h) - (1 + outer_size) * 2;
             const Rect outer(1+outer_size, 1+outer_size, boxSize, boxSize);
@@ -459,10 +2127,16 @@ struct RadioBox : CheckBox
             const Rect fontArea(outer.x + outer.width + 3, outer.y, w - outer.width - 4, outer.height);            
 
             area = screen.bg(roi);
-            area = toScalar(color);            
-            circle(area, center, outer_radius, s == DISABLED ? color_disabled : outer_color, outer_size);
-            if (checked) fill(area, center, inner_radius, s == DISABLED ? color_disabled : inner_color);
-            font.putText(area, fontArea, text, s == DISABLED, align);            
+            screen.invalidate(roi);
+            BitmapCache *cache = widgetCache(cached, this->cache);
+            const string key = cache ? stateKey('R', text, s) : string();
+            if (!blitCached(cache, key, area)) {
+                area = toScalar(color);            
+                circle(area, center, outer_radius, s == DISABLED ? color_disabled : outer_color, outer_size);
+                if (checked) fill(area, center, inner_radius, s == DISABLED ? color_disabled : inner_color);
+                font.putText(area, fontArea, text, s == DISABLED, align, color);            
+                storeCached(cache, key, area);
+            }
         }
         return status;
     }  
@@ -477,16 +2151,19 @@ struct RangeBox : CheckBox
     int operator()(Screen &screen, float &val, float minval, float maxval, float step,
                    int x, int y, int w, int h) {
         const Rect roi(x, y, w, h);
-        const int s = disabled ? DISABLED : mouseStatus(roi, IDLE|PRESSED);
+        const int s = widgetStatus(screen, this, roi, disabled, IDLE|PRESSED);
         bool val_changed = false;
         if (s == PRESSED) {
             val += step;
             val = val < minval ? minval : (val > maxval ? minval : val);
             val_changed = true;
         }
+        const float range[3] = {val, minval, maxval}; // also set by the caller
+        const uint64_t fp = contentHash(range, sizeof(range));
                     
-        if (s != status || val_changed) {
+        if (s != status || val_changed || fp != content) {
             status = s;            
+            content = fp;
             char text[16];
             snprintf(text, 16, "%0.2lf", val);                      
             const Rect outer(1+outer_size, 1+outer_size, w-2*(1+outer_size), h-2*(1+outer_size));
@@ -495,6 +2172,7 @@ struct RangeBox : CheckBox
             const Rect filled(inner.x, inner.y, inner.width * percent, inner.height);
             
             area = screen.bg(roi);
+            screen.invalidate(roi);
             area = toScalar(color);            
             rectangle(area, outer, disabled ? color_disabled : outer_color, outer_size); 
             fill(area, filled, disabled ? color_disabled : inner_color);
@@ -521,6 +2199,8 @@ struct Line {
         if (s != status) {
             status = s;
             line(screen.bg, Point(x0, y0), Point(x1, y1), s == DISABLED ? color_disabled : color, thickness);
+            const Rect bound(Point(x0, y0), Point(x1, y1));
+            screen.invalidate(Rect(bound.x - thickness, bound.y - thickness, bound.width + 2*thickness + 1, bound.height + 2*thickness + 1));
         }
         return status;
     }
@@ -538,15 +2218,17 @@ struct Keyboard
         num_disabled = false;
         char_disabled = false;
         entered = false;
+        opened = false;
         textLabel.color = colorAdd(color, -10);
         maxLen = 32;
+        for (int i = 0; i < 40; ++i) b[i].cached = true; // hovering repaints keys a lot
     }
     
+    // call it every frame from the caller's loop while it's open, after the widgets
+    // under it, it returns OPEN and finally ENTERED, or CANCELLED with esc (input 
+    // goes back to what it was). It repaints when they drew over it; what's under
+    // it is restored as it was when opened, redraw() the ones that changed since
     int operator() (Screen &screen, std::string &input, int x, int y, int w, int type=KB_FULL, int maxlen = 32) {
-        btnGap = (int)(w * 0.1f * 0.1f);
-        btnSize = (int)((w + btnGap) * 0.1f - btnGap);
-        const Rect kbroi(x, y, 10*(btnSize + btnGap) - btnGap + 2, 5*(btnSize + btnGap) - 2 * btnGap + 2);
-        
         switch(type) {
         case KB_FULL: num_disabled = false; char_disabled = false; break;
         case KB_NUM:  num_disabled = false; char_disabled = true; break;
@@ -554,36 +2236,53 @@ struct Keyboard
         default: ASSERT(0); break;
         }
         
-        area = screen.bg(kbroi);
-        cloneTo(area, prevKBRoiImg);
-        area = toScalar(color);
-        startX = kbroi.x + 1; startY = kbroi.y + 1;        
-        entered = false;
         inputPtr = &input;
         screenPtr = &screen;
         maxLen = maxlen;
-        reset();
-        
-        while (!entered) {
-            if (CLICKED == textLabel(screen, input, startX, startY, kbroi.width-2, btnSize)-2) {
-                input.clear();
-                textLabel.redraw();
-            }
-                
-            keyId = 0;
-            K("1");K("2");K("3");K("4");K("5");K("6");K("7");K("8");K("9");K("0");
-            K("Q");K("W");K("E");K("R");K("T");K("Y");K("U");K("I");K("O");K("P");
-            K("A");K("S");K("D");K("F");K("G");K("H");K("J");K("K");K("L");K("Del");
-            K("Z");K("X");K("C");K("V");K("B");K("N");K("M");K("_");K("@");K("En");
-
-            if (27 == screen.show()) {
-                break;
-            }
+        if (!opened) { // save what's under it only once
+            btnGap = (int)(w * 0.1f * 0.1f);
+            btnSize = (int)((w + btnGap) * 0.1f - btnGap);
+            kbroi = Rect(x, y, 10*(btnSize + btnGap) - btnGap + 2, 5*(btnSize + btnGap) - 2 * btnGap + 2);
+            area = screen.bg(kbroi);
+            cloneTo(area, prevKBRoiImg);
+            area = toScalar(color);
+            screen.invalidate(kbroi);
+            startX = kbroi.x + 1; startY = kbroi.y + 1;        
+            entered = false;
+            original = input;
+            reset();
+            opened = true;
+        }
+        else if (screen.lastKey == 27) {
+            return cancel();
+        }
+        else if (screen.isDamaged(kbroi)) { // widgets under it drew over the keys
+            area = toScalar(color);
+            screen.invalidate(kbroi);
+            reset();
         }
         
-        copyTo(prevKBRoiImg, area);
-        return IDLE;
+        if (CLICKED == textLabel(screen, input, startX, startY, kbroi.width-2, btnSize)-2) {
+            input.clear();
+        }
+                
+        keyId = 0;
+        K("1");K("2");K("3");K("4");K("5");K("6");K("7");K("8");K("9");K("0");
+        K("Q");K("W");K("E");K("R");K("T");K("Y");K("U");K("I");K("O");K("P");
+        K("A");K("S");K("D");K("F");K("G");K("H");K("J");K("K");K("L");K("Del");
+        K("Z");K("X");K("C");K("V");K("B");K("N");K("M");K("_");K("@");K("En");
+
+        return entered ? close(ENTERED) : OPEN;
     }
+    
+    // close it from the caller, the input is restored
+    int cancel() {
+        if (!opened) return CANCELLED;
+        *inputPtr = original;
+        return close(CANCELLED);
+    }
+    
+    bool isOpen() const {return opened;}
 
     void reset() {
         textLabel.reset();
@@ -594,6 +2293,13 @@ struct Keyboard
     }
 
 private:
+    int close(int result) {
+        copyTo(prevKBRoiImg, area);
+        screenPtr->invalidate(kbroi);
+        opened = false;
+        return result;
+    }
+    
     inline void K(const string &text) {
         const int r = keyId / 10, c = keyId % 10;        
 #define PUTBUTTON(btn) (btn)(*screenPtr, text,                          \
@@ -604,16 +2310,12 @@ private:
             b[keyId].disable(keyId < 10 ? num_disabled : char_disabled);
             if (CLICKED == PUTBUTTON(b[keyId]) && inputPtr->size() < maxLen) {
                 inputPtr->append(text);
-                textLabel.redraw();
             }
         }
         else if (keyId == 29) { // Del
             if (CLICKED == PUTBUTTON(b[keyId])) {
                 const int sz = inputPtr->size();
-                if (sz > 0) {
-                    inputPtr->erase(sz-1);
-                    textLabel.redraw();
-                }
+                if (sz > 0) inputPtr->erase(sz-1);
             }                
         }
         else if (keyId == 39) { // Enter
@@ -632,6 +2334,9 @@ private:
     bool num_disabled;
     bool char_disabled;
     bool entered;
+    bool opened;
+    Rect kbroi;
+    string original; // input when it was opened
     Label textLabel;
     Screen *screenPtr;
     string *inputPtr;
@@ -645,6 +2350,7 @@ struct MessageBox
 {
     MessageBox() {
         status = INIT;
+        opened = false;
         msgLabel.font.color = 0xE3D567;
         msgLabel.font.scale = 0.7f;
     }
@@ -655,24 +2361,52 @@ struct MessageBox
         okBtn.reset();
     }
 
+    // call it every frame from the caller's loop while it's open, after the widgets
+    // under it, it returns OPEN and finally ENTERED (OK) or CANCELLED (esc); same
+    // as Keyboard with widgets under it
     int operator()(Screen &screen, const string &msg, int x, int y, int w, int h) {
-        const Rect roi(x,y,w,h);
-        reset();
-        area = screen.bg(roi);
-        cloneTo(area, prevRoiImg);
-        area(Rect(2, 2, w-4, 143)) = toScalar(0x161616);
-        while (1) {
-            msgLabel(screen, msg, x+3, y+3, w-6, 60);            
-            if (okBtn(screen, "OK", x+3, y+80+3, w-6, 60) == CLICKED) break;            
-            if (27 == screen.show()) break;
-        }        
-        copyTo(prevRoiImg, area);
-        return 0;
+        if (!opened) { // save what's under it only once
+            roi = Rect(x,y,w,h);
+            reset();
+            area = screen.bg(roi);
+            cloneTo(area, prevRoiImg);
+            area(Rect(2, 2, w-4, 143)) = toScalar(0x161616);
+            screen.invalidate(roi);
+            screenPtr = &screen;
+            opened = true;
+        }
+        else if (screen.lastKey == 27) {
+            return close(CANCELLED);
+        }
+        else if (screen.isDamaged(roi)) { // widgets under it drew over it
+            area(Rect(2, 2, w-4, 143)) = toScalar(0x161616);
+            screen.invalidate(roi);
+            reset();
+        }
+        
+        msgLabel(screen, msg, x+3, y+3, w-6, 60);            
+        if (okBtn(screen, "OK", x+3, y+80+3, w-6, 60) == CLICKED) return close(ENTERED);
+        return OPEN;
     }
+    
+    // close it from the caller
+    int cancel() {return opened ? close(CANCELLED) : CANCELLED;}
+    
+    bool isOpen() const {return opened;}
 
 private:
+    int close(int result) {
+        copyTo(prevRoiImg, area);
+        screenPtr->invalidate(roi);
+        opened = false;
+        return result;
+    }
+    
     int status;
     uint color;
+    bool opened;
+    Rect roi;
+    Screen *screenPtr;
     Label msgLabel;
     Button okBtn;
     Mat area, prevRoiImg;
@@ -25,7 +25,15 @@
 #include "sui.h"
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+#include <X11/extensions/Xrender.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
 #include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -49,21 +57,43 @@ getticks() {
     return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
+/*
+ * sui_image holds pixels in the format of the X visual (SUI_FORMAT_*), 
+ * bpp bytes per pixel, rows are 4 bytes aligned.
+ */
 typedef struct {
-    int w, h, ws, cn;
+    int w, h, ws, bpp, format;
     uint8_t *imgdata;
 } sui_image;
 
+static int
+sui_format_bpp(int format) {
+    return format == SUI_FORMAT_RGB565 ? 2 : 4;
+}
+
 static sui_image*
-sui_image_create(int w, int h) {
-    sui_image *img = (sui_image *)malloc(sizeof(*img) + w * h * 4);
+sui_image_create(int w, int h, int format) {
+    const int bpp = sui_format_bpp(format);
+    const int ws = (w * bpp + 3) & ~3;
+    sui_image *img = (sui_image *)malloc(sizeof(*img) + ws * h);
     if (img) {
-        img->w = w; img->h = h; img->ws = 4 * img->w; img->cn = 4;
+        img->w = w; img->h = h; img->ws = ws; img->bpp = bpp; img->format = format;
         img->imgdata = (uint8_t *)(img + 1);
     }
     return img;
 }
 
+// wrap external memory (e.g. a shared memory segment), the data is not owned
+static sui_image*
+sui_image_wrap(int w, int h, int ws, int format, uint8_t *imgdata) {
+    sui_image *img = (sui_image *)malloc(sizeof(*img));
+    if (img) {
+        img->w = w; img->h = h; img->ws = ws; img->bpp = sui_format_bpp(format); img->format = format;
+        img->imgdata = imgdata;
+    }
+    return img;
+}
+
 static int
 sui_image_destroy(sui_image **pp) {
     if (pp && *pp) {
@@ -73,61 +103,532 @@ sui_image_destroy(sui_image **pp) {
     return -1;
 }
 
+// copy pixels between images of the same format
+static void
+sui_image_blit(sui_image *dst, const sui_image *src) {
+    const int w = dst->w < src->w ? dst->w : src->w;
+    const int h = dst->h < src->h ? dst->h : src->h;
+    ASSERT(dst->format == src->format);
+    for (int i = 0; i < h; ++i) {
+        memcpy(dst->imgdata + i * dst->ws, src->imgdata + i * src->ws, sizeof(uint8_t) * w * dst->bpp);
+    }
+}
+
+/*
+ * Pixel conversion kernels, each one converts a row of n pixels from gray, BGR
+ * or BGRX into one of the SUI_FORMAT_*. The scalar ones are the reference 
+ * implementations, the SIMD ones are picked at runtime by sui_init_kernels and
+ * must produce exactly the same bytes. No kernel reads past src + n * cn.
+ */
+typedef void (* sui_row_kernel)(uint8_t *dst, const uint8_t *src, int n);
+
+static void
+sui_gray_to_bgrx_ref(uint8_t *dst, const uint8_t *src, int n) {
+    for (int j = 0; j < n; ++j) {
+        dst[0] = dst[1] = dst[2] = src[j];
+        dst[3] = 0;
+        dst += 4;
+    }
+}
+
+static void
+sui_bgr_to_bgrx_ref(uint8_t *dst, const uint8_t *src, int n) {
+    for (int j = 0; j < n; ++j) {
+        dst[0] = src[0];
+        dst[1] = src[1];
+        dst[2] = src[2];
+        dst[3] = 0;
+        dst += 4; src += 3;
+    }
+}
+
+static void
+sui_bgrx_to_bgrx_ref(uint8_t *dst, const uint8_t *src, int n) {
+    memcpy(dst, src, sizeof(uint8_t) * n * 4);
+}
+
+static void
+sui_bgr_to_rgbx_ref(uint8_t *dst, const uint8_t *src, int n) {
+    for (int j = 0; j < n; ++j) {
+        dst[0] = src[2];
+        dst[1] = src[1];
+        dst[2] = src[0];
+        dst[3] = 0;
+        dst += 4; src += 3;
+    }
+}
+
+static void
+sui_bgrx_to_rgbx_ref(uint8_t *dst, const uint8_t *src, int n) {
+    for (int j = 0; j < n; ++j) {
+        dst[0] = src[2];
+        dst[1] = src[1];
+        dst[2] = src[0];
+        dst[3] = 0;
+        dst += 4; src += 4;
+    }
+}
+
+#define SUI_RGB565(b, g, r) ((uint16_t)((((r) >> 3) << 11) | (((g) >> 2) << 5) | ((b) >> 3)))
+
+static void
+sui_gray_to_rgb565_ref(uint8_t *dst, const uint8_t *src, int n) {
+    uint16_t *d = (uint16_t *)dst;
+    for (int j = 0; j < n; ++j) {
+        d[j] = SUI_RGB565(src[j], src[j], src[j]);
+    }
+}
+
+static void
+sui_bgr_to_rgb565_ref(uint8_t *dst, const uint8_t *src, int n) {
+    uint16_t *d = (uint16_t *)dst;
+    for (int j = 0; j < n; ++j) {
+        d[j] = SUI_RGB565(src[0], src[1], src[2]);
+        src += 3;
+    }
+}
+
+static void
+sui_bgrx_to_rgb565_ref(uint8_t *dst, const uint8_t *src, int n) {
+    uint16_t *d = (uint16_t *)dst;
+    for (int j = 0; j < n; ++j) {
+        d[j] = SUI_RGB565(src[0], src[1], src[2]);
+        src += 4;
+    }
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SUI_X86 1
+#include <immintrin.h>
+
+__attribute__((target("sse2"))) static void
+sui_gray_to_bgrx_sse2(uint8_t *dst, const uint8_t *src, int n) {
+    const __m128i zero = _mm_setzero_si128();
+    int j = 0;
+    for (; j + 16 <= n; j += 16) {
+        const __m128i g = _mm_loadu_si128((const __m128i *)(src + j));
+        const __m128i gg_lo = _mm_unpacklo_epi8(g, g), gz_lo = _mm_unpacklo_epi8(g, zero);
+        const __m128i gg_hi = _mm_unpackhi_epi8(g, g), gz_hi = _mm_unpackhi_epi8(g, zero);
+        __m128i *d = (__m128i *)(dst + j * 4);
+        _mm_storeu_si128(d + 0, _mm_unpacklo_epi16(gg_lo, gz_lo)); // g g g 0 
+        _mm_storeu_si128(d + 1, _mm_unpackhi_epi16(gg_lo, gz_lo));
+        _mm_storeu_si128(d + 2, _mm_unpacklo_epi16(gg_hi, gz_hi));
+        _mm_storeu_si128(d + 3, _mm_unpackhi_epi16(gg_hi, gz_hi));
+    }
+    sui_gray_to_bgrx_ref(dst + j * 4, src + j, n - j);
+}
+
+// 8 pixels of 32 bits (b, g, r in the low bytes) to RGB565 
+__attribute__((target("sse2"))) static inline __m128i
+sui_pack_rgb565_sse2(__m128i p0, __m128i p1) {
+    const __m128i mb = _mm_set1_epi32(0x001F), mg = _mm_set1_epi32(0x07E0), mr = _mm_set1_epi32(0xF800);
+    const __m128i bias = _mm_set1_epi32(0x8000);
+    __m128i v0 = _mm_or_si128(_mm_and_si128(_mm_srli_epi32(p0, 3), mb),
+                              _mm_or_si128(_mm_and_si128(_mm_srli_epi32(p0, 5), mg), _mm_and_si128(_mm_srli_epi32(p0, 8), mr)));
+    __m128i v1 = _mm_or_si128(_mm_and_si128(_mm_srli_epi32(p1, 3), mb),
+                              _mm_or_si128(_mm_and_si128(_mm_srli_epi32(p1, 5), mg), _mm_and_si128(_mm_srli_epi32(p1, 8), mr)));
+    // SSE2 only packs with signed saturation, shift the range around it 
+    v0 = _mm_sub_epi32(v0, bias);
+    v1 = _mm_sub_epi32(v1, bias);
+    return _mm_xor_si128(_mm_packs_epi32(v0, v1), _mm_set1_epi16((short)0x8000));
+}
+
+__attribute__((target("sse2"))) static void
+sui_gray_to_rgb565_sse2(uint8_t *dst, const uint8_t *src, int n) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i mg = _mm_set1_epi16(0x07E0), mr = _mm_set1_epi16((short)0xF800);
+    int j = 0;
+    for (; j + 16 <= n; j += 16) {
+        const __m128i g = _mm_loadu_si128((const __m128i *)(src + j));
+        const __m128i lo = _mm_unpacklo_epi8(g, zero), hi = _mm_unpackhi_epi8(g, zero);
+        __m128i *d = (__m128i *)(dst + j * 2);
+        _mm_storeu_si128(d + 0, _mm_or_si128(_mm_or_si128(_mm_and_si128(_mm_slli_epi16(lo, 8), mr),
+                                                          _mm_and_si128(_mm_slli_epi16(lo, 3), mg)), _mm_srli_epi16(lo, 3)));
+        _mm_storeu_si128(d + 1, _mm_or_si128(_mm_or_si128(_mm_and_si128(_mm_slli_epi16(hi, 8), mr),
+                                                          _mm_and_si128(_mm_slli_epi16(hi, 3), mg)), _mm_srli_epi16(hi, 3)));
+    }
+    sui_gray_to_rgb565_ref(dst + j * 2, src + j, n - j);
+}
+
+__attribute__((target("sse2"))) static void
+sui_bgrx_to_rgb565_sse2(uint8_t *dst, const uint8_t *src, int n) {
+    int j = 0;
+    for (; j + 8 <= n; j += 8) {
+        const __m128i p0 = _mm_loadu_si128((const __m128i *)(src + j * 4));
+        const __m128i p1 = _mm_loadu_si128((const __m128i *)(src + j * 4 + 16));
+        _mm_storeu_si128((__m128i *)(dst + j * 2), sui_pack_rgb565_sse2(p0, p1));
+    }
+    sui_bgrx_to_rgb565_ref(dst + j * 2, src + j * 4, n - j);
+}
+
+// SSE2 has no byte shuffle, the BGR kernels need SSSE3's pshufb
+#define SUI_BGRX_MASK 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1
+#define SUI_RGBX_MASK 2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1
+
+// 16 BGR pixels, 48 bytes, into 4 vectors of 4 pixels shuffled by mask
+__attribute__((target("ssse3"))) static inline void
+sui_load_bgr16_ssse3(const uint8_t *src, __m128i mask, __m128i *out) {
+    const __m128i a = _mm_loadu_si128((const __m128i *)src);
+    const __m128i b = _mm_loadu_si128((const __m128i *)(src + 16));
+    const __m128i c = _mm_loadu_si128((const __m128i *)(src + 32));
+    out[0] = _mm_shuffle_epi8(a, mask);
+    out[1] = _mm_shuffle_epi8(_mm_alignr_epi8(b, a, 12), mask);
+    out[2] = _mm_shuffle_epi8(_mm_alignr_epi8(c, b, 8), mask);
+    out[3] = _mm_shuffle_epi8(_mm_srli_si128(c, 4), mask);
+}
+
+__attribute__((target("ssse3"))) static void
+sui_bgr_to_bgrx_ssse3(uint8_t *dst, const uint8_t *src, int n) {
+    const __m128i mask = _mm_setr_epi8(SUI_BGRX_MASK);
+    __m128i v[4];
+    int j = 0;
+    for (; j + 16 <= n; j += 16) { // 48 bytes in, 64 bytes out 
+        __m128i *d = (__m128i *)(dst + j * 4);
+        sui_load_bgr16_ssse3(src + j * 3, mask, v);
+        _mm_storeu_si128(d + 0, v[0]);
+        _mm_storeu_si128(d + 1, v[1]);
+        _mm_storeu_si128(d + 2, v[2]);
+        _mm_storeu_si128(d + 3, v[3]);
+    }
+    sui_bgr_to_bgrx_ref(dst + j * 4, src + j * 3, n - j);
+}
+
+__attribute__((target("ssse3"))) static void
+sui_bgr_to_rgbx_ssse3(uint8_t *dst, const uint8_t *src, int n) {
+    const __m128i mask = _mm_setr_epi8(SUI_RGBX_MASK);
+    __m128i v[4];
+    int j = 0;
+    for (; j + 16 <= n; j += 16) {
+        __m128i *d = (__m128i *)(dst + j * 4);
+        sui_load_bgr16_ssse3(src + j * 3, mask, v);
+        _mm_storeu_si128(d + 0, v[0]);
+        _mm_storeu_si128(d + 1, v[1]);
+        _mm_storeu_si128(d + 2, v[2]);
+        _mm_storeu_si128(d + 3, v[3]);
+    }
+    sui_bgr_to_rgbx_ref(dst + j * 4, src + j * 3, n - j);
+}
+
+__attribute__((target("ssse3"))) static void
+sui_bgrx_to_rgbx_ssse3(uint8_t *dst, const uint8_t *src, int n) {
+    const __m128i mask = _mm_setr_epi8(2, 1, 0, -1, 6, 5, 4, -1, 10, 9, 8, -1, 14, 13, 12, -1);
+    int j = 0;
+    for (; j + 4 <= n; j += 4) {
+        const __m128i p = _mm_loadu_si128((const __m128i *)(src + j * 4));
+        _mm_storeu_si128((__m128i *)(dst + j * 4), _mm_shuffle_epi8(p, mask));
+    }
+    sui_bgrx_to_rgbx_ref(dst + j * 4, src + j * 4, n - j);
+}
+
+__attribute__((target("ssse3"))) static void
+sui_bgr_to_rgb565_ssse3(uint8_t *dst, const uint8_t *src, int n) {
+    const __m128i mask = _mm_setr_epi8(SUI_BGRX_MASK);
+    __m128i v[4];
+    int j = 0;
+    for (; j + 16 <= n; j += 16) { // 48 bytes in, 32 bytes out 
+        __m128i *d = (__m128i *)(dst + j * 2);
+        sui_load_bgr16_ssse3(src + j * 3, mask, v);
+        _mm_storeu_si128(d + 0, sui_pack_rgb565_sse2(v[0], v[1]));
+        _mm_storeu_si128(d + 1, sui_pack_rgb565_sse2(v[2], v[3]));
+    }
+    sui_bgr_to_rgb565_ref(dst + j * 2, src + j * 3, n - j);
+}
+
+__attribute__((target("avx2"))) static void
+sui_gray_to_bgrx_avx2(uint8_t *dst, const uint8_t *src, int n) {
+    int j = 0;
+    for (; j + 16 <= n; j += 16) {
+        const __m256i g0 = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(src + j)));
+        const __m256i g1 = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(src + j + 8)));
+        __m256i *d = (__m256i *)(dst + j * 4);
+        _mm256_storeu_si256(d + 0, _mm256_or_si256(g0, _mm256_or_si256(_mm256_slli_epi32(g0, 8), _mm256_slli_epi32(g0, 16))));
+        _mm256_storeu_si256(d + 1, _mm256_or_si256(g1, _mm256_or_si256(_mm256_slli_epi32(g1, 8), _mm256_slli_epi32(g1, 16))));
+    }
+    sui_gray_to_bgrx_sse2(dst + j * 4, src + j, n - j);
+}
+
+// each lane takes 4 pixels from a 16 bytes load, needs n - j >= 18 to keep the last load inside the row 
+__attribute__((target("avx2"))) static inline void
+sui_load_bgr16_avx2(const uint8_t *p, __m256i mask, __m256i *out) {
+    const __m256i a = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)p)),
+                                              _mm_loadu_si128((const __m128i *)(p + 12)), 1);
+    const __m256i b = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(p + 24))),
+                                              _mm_loadu_si128((const __m128i *)(p + 36)), 1);
+    out[0] = _mm256_shuffle_epi8(a, mask);
+    out[1] = _mm256_shuffle_epi8(b, mask);
+}
+
+__attribute__((target("avx2"))) static void
+sui_bgr_to_bgrx_avx2(uint8_t *dst, const uint8_t *src, int n) {
+    const __m256i mask = _mm256_setr_epi8(SUI_BGRX_MASK, SUI_BGRX_MASK);
+    __m256i v[2];
+    int j = 0;
+    for (; j + 18 <= n; j += 16) {
+        __m256i *d = (__m256i *)(dst + j * 4);
+        sui_load_bgr16_avx2(src + j * 3, mask, v);
+        _mm256_storeu_si256(d + 0, v[0]);
+        _mm256_storeu_si256(d + 1, v[1]);
+    }
+    sui_bgr_to_bgrx_ssse3(dst + j * 4, src + j * 3, n - j);
+}
+
+__attribute__((target("avx2"))) static void
+sui_bgr_to_rgbx_avx2(uint8_t *dst, const uint8_t *src, int n) {
+    const __m256i mask = _mm256_setr_epi8(SUI_RGBX_MASK, SUI_RGBX_MASK);
+    __m256i v[2];
+    int j = 0;
+    for (; j + 18 <= n; j += 16) {
+        __m256i *d = (__m256i *)(dst + j * 4);
+        sui_load_bgr16_avx2(src + j * 3, mask, v);
+        _mm256_storeu_si256(d + 0, v[0]);
+        _mm256_storeu_si256(d + 1, v[1]);
+    }
+    sui_bgr_to_rgbx_ssse3(dst + j * 4, src + j * 3, n - j);
+}
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define SUI_NEON 1
+#include <arm_neon.h>
+
+static void
+sui_gray_to_bgrx_neon(uint8_t *dst, const uint8_t *src, int n) {
+    int j = 0;
+    for (; j + 16 <= n; j += 16) {
+        uint8x16x4_t v;
+        v.val[0] = v.val[1] = v.val[2] = vld1q_u8(src + j);
+        v.val[3] = vdupq_n_u8(0);
+        vst4q_u8(dst + j * 4, v);
+    }
+    sui_gray_to_bgrx_ref(dst + j * 4, src + j, n - j);
+}
+
+static void
+sui_bgr_to_bgrx_neon(uint8_t *dst, const uint8_t *src, int n) {
+    int j = 0;
+    for (; j + 16 <= n; j += 16) {
+        const uint8x16x3_t bgr = vld3q_u8(src + j * 3);
+        uint8x16x4_t v;
+        v.val[0] = bgr.val[0];
+        v.val[1] = bgr.val[1];
+        v.val[2] = bgr.val[2];
+        v.val[3] = vdupq_n_u8(0);
+        vst4q_u8(dst + j * 4, v);
+    }
+    sui_bgr_to_bgrx_ref(dst + j * 4, src + j * 3, n - j);
+}
+
+static void
+sui_bgr_to_rgbx_neon(uint8_t *dst, const uint8_t *src, int n) {
+    int j = 0;
+    for (; j + 16 <= n; j += 16) {
+        const uint8x16x3_t bgr = vld3q_u8(src + j * 3);
+        uint8x16x4_t v;
+        v.val[0] = bgr.val[2];
+        v.val[1] = bgr.val[1];
+        v.val[2] = bgr.val[0];
+        v.val[3] = vdupq_n_u8(0);
+        vst4q_u8(dst + j * 4, v);
+    }
+    sui_bgr_to_rgbx_ref(dst + j * 4, src + j * 3, n - j);
+}
+
+static void
+sui_bgrx_to_rgbx_neon(uint8_t *dst, const uint8_t *src, int n) {
+    int j = 0;
+    for (; j + 16 <= n; j += 16) {
+        const uint8x16x4_t bgrx = vld4q_u8(src + j * 4);
+        uint8x16x4_t v;
+        v.val[0] = bgrx.val[2];
+        v.val[1] = bgrx.val[1];
+        v.val[2] = bgrx.val[0];
+        v.val[3] = vdupq_n_u8(0);
+        vst4q_u8(dst + j * 4, v);
+    }
+    sui_bgrx_to_rgbx_ref(dst + j * 4, src + j * 4, n - j);
+}
+
+// 8 pixels to RGB565 by shifting the channels into place
+static inline uint16x8_t
+sui_pack_rgb565_neon(uint8x8_t b, uint8x8_t g, uint8x8_t r) {
+    uint16x8_t v = vshll_n_u8(r, 8);
+    v = vsriq_n_u16(v, vshll_n_u8(g, 8), 5);
+    v = vsriq_n_u16(v, vshll_n_u8(b, 8), 11);
+    return v;
+}
+
+static void
+sui_gray_to_rgb565_neon(uint8_t *dst, const uint8_t *src, int n) {
+    uint16_t *d = (uint16_t *)dst;
+    int j = 0;
+    for (; j + 8 <= n; j += 8) {
+        const uint8x8_t g = vld1_u8(src + j);
+        vst1q_u16(d + j, sui_pack_rgb565_neon(g, g, g));
+    }
+    sui_gray_to_rgb565_ref(dst + j * 2, src + j, n - j);
+}
+
+static void
+sui_bgr_to_rgb565_neon(uint8_t *dst, const uint8_t *src, int n) {
+    uint16_t *d = (uint16_t *)dst;
+    int j = 0;
+    for (; j + 8 <= n; j += 8) {
+        const uint8x8x3_t v = vld3_u8(src + j * 3);
+        vst1q_u16(d + j, sui_pack_rgb565_neon(v.val[0], v.val[1], v.val[2]));
+    }
+    sui_bgr_to_rgb565_ref(dst + j * 2, src + j * 3, n - j);
+}
+
+static void
+sui_bgrx_to_rgb565_neon(uint8_t *dst, const uint8_t *src, int n) {
+    uint16_t *d = (uint16_t *)dst;
+    int j = 0;
+    for (; j + 8 <= n; j += 8) {
+        const uint8x8x4_t v = vld4_u8(src + j * 4);
+        vst1q_u16(d + j, sui_pack_rgb565_neon(v.val[0], v.val[1], v.val[2]));
+    }
+    sui_bgrx_to_rgb565_ref(dst + j * 2, src + j * 4, n - j);
+}
+#endif
+
+// indexed by SUI_FORMAT_* and the number of channels of the source (1, 3 or 4)
+static const sui_row_kernel sui_ref_kernels[3][5] = {
+    {NULL, sui_gray_to_bgrx_ref,   NULL, sui_bgr_to_bgrx_ref,   sui_bgrx_to_bgrx_ref}, // memcpy is vectorized already
+    {NULL, sui_gray_to_bgrx_ref,   NULL, sui_bgr_to_rgbx_ref,   sui_bgrx_to_rgbx_ref}, // gray is the same in both orders
+    {NULL, sui_gray_to_rgb565_ref, NULL, sui_bgr_to_rgb565_ref, sui_bgrx_to_rgb565_ref},
+};
+// the ones in use, set by sui_init_kernels
+static sui_row_kernel sui_kernels[3][5];
+
+// pick the fastest kernels this cpu supports, define SUI_NO_SIMD to use the reference ones
+static void
+sui_pick_kernels(void) {
+    memcpy(sui_kernels, sui_ref_kernels, sizeof(sui_kernels));
+#if !defined(SUI_NO_SIMD)
+#if defined(SUI_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        sui_kernels[SUI_FORMAT_BGRX][1]   = sui_gray_to_bgrx_sse2;
+        sui_kernels[SUI_FORMAT_RGBX][1]   = sui_gray_to_bgrx_sse2;
+        sui_kernels[SUI_FORMAT_RGB565][1] = sui_gray_to_rgb565_sse2;
+        sui_kernels[SUI_FORMAT_RGB565][4] = sui_bgrx_to_rgb565_sse2;
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        sui_kernels[SUI_FORMAT_BGRX][3]   = sui_bgr_to_bgrx_ssse3;
+        sui_kernels[SUI_FORMAT_RGBX][3]   = sui_bgr_to_rgbx_ssse3;
+        sui_kernels[SUI_FORMAT_RGBX][4]   = sui_bgrx_to_rgbx_ssse3;
+        sui_kernels[SUI_FORMAT_RGB565][3] = sui_bgr_to_rgb565_ssse3;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        sui_kernels[SUI_FORMAT_BGRX][1] = sui_gray_to_bgrx_avx2;
+        sui_kernels[SUI_FORMAT_RGBX][1] = sui_gray_to_bgrx_avx2;
+        sui_kernels[SUI_FORMAT_BGRX][3] = sui_bgr_to_bgrx_avx2;
+        sui_kernels[SUI_FORMAT_RGBX][3] = sui_bgr_to_rgbx_avx2;
+    }
+#elif defined(SUI_NEON)
+    sui_kernels[SUI_FORMAT_BGRX][1]   = sui_gray_to_bgrx_neon;
+    sui_kernels[SUI_FORMAT_RGBX][1]   = sui_gray_to_bgrx_neon;
+    sui_kernels[SUI_FORMAT_BGRX][3]   = sui_bgr_to_bgrx_neon;
+    sui_kernels[SUI_FORMAT_RGBX][3]   = sui_bgr_to_rgbx_neon;
+    sui_kernels[SUI_FORMAT_RGBX][4]   = sui_bgrx_to_rgbx_neon;
+    sui_kernels[SUI_FORMAT_RGB565][1] = sui_gray_to_rgb565_neon;
+    sui_kernels[SUI_FORMAT_RGB565][3] = sui_bgr_to_rgb565_neon;
+    sui_kernels[SUI_FORMAT_RGB565][4] = sui_bgrx_to_rgb565_neon;
+#endif
+#endif
+}
+
+// once per process, other threads may be converting with the table already 
+static void
+sui_init_kernels(void) {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, sui_pick_kernels);
+}
+
 static int
 sui_image_set(sui_image *img, uint8_t b, uint8_t g, uint8_t r) {
-    uint8_t *p;
+    const uint8_t bgr[3] = {b, g, r};
+    uint8_t px[4];
     int i, j;
     if (img == NULL || img->imgdata == NULL) return -1;
-    p = img->imgdata;
+    sui_kernels[img->format][3](px, bgr, 1);
     for (i = 0; i < img->h; ++i) {
+        uint8_t *p = img->imgdata + i * img->ws;
         for (j = 0; j < img->w; ++j) {
-            *p++ = b;
-            *p++ = g;
-            *p++ = r;
-            ++p;
+            memcpy(p, px, img->bpp);
+            p += img->bpp;
         }
     }
     return 0;
 }
 
-#pragma GCC push_options
-#pragma GCC optimize ("unroll-loops")
+/* 
+ * copy the region (x, y, rw, rh) of the source image into the same place of img,
+ * the region must be inside both images.
+ */
 static int
-sui_image_copy(sui_image *img, const uint8_t *imgdata, int w, int h, int ws, int cn) {
+sui_image_copy(sui_image *img, const uint8_t *imgdata, int w, int h, int ws, int cn,
+               int x, int y, int rw, int rh) {
+    sui_row_kernel kernel;
     if (cn != 1 && cn != 3 && cn != 4) {
         return -1;
     }
+    kernel = sui_kernels[img->format][cn];
+    
+    ASSERT(x >= 0 && y >= 0 && x + rw <= w && y + rh <= h && x + rw <= img->w && y + rh <= img->h);
     
-    if (img->w == w && img->h == h && img->ws == ws && img->cn == cn) {
-        memcpy(img->imgdata, imgdata, sizeof(uint8_t) * ws * h);
+    if (cn == 4 && img->format == SUI_FORMAT_BGRX && x == 0 && rw == w && rw == img->w && ws == img->ws) { // one block 
+        memcpy(img->imgdata + y * ws, imgdata + y * ws, sizeof(uint8_t) * ws * rh);
     }
     else {
-        if (cn == 1) { // gray scale image
-            uint8_t *ps = img->imgdata;
-            const uint8_t *pd = imgdata;        
-            for (int i = 0; i < h; ++i) {
-                for (int j = 0; j < w; ++j) {
-                    ps[0] = ps[1] = ps[2] = *pd++;
-                    ps += 4;
-                }
-                pd += ws - w;
-            }
+        for (int i = y; i < y + rh; ++i) {
+            kernel(img->imgdata + i * img->ws + x * img->bpp, imgdata + i * ws + x * cn, rw);
         }
-        else if (cn == 3) {
-            uint32_t *psi = (uint32_t *)img->imgdata;
-            const uint8_t *pd = imgdata;
-            for (int i = 0; i < h; ++i) {
-                for (int j = 0; j < w; ++j) {
-                    *psi++ = *(const uint32_t*)pd;
-                    pd += 3;
+    }
+    return 0;
+}
+
+int
+sui_check_kernels(void) {
+    static const int widths[] = {127, 129, 255, 257, 1023};
+    int failed = 0;
+    sui_init_kernels();
+    for (int format = 0; format < 3; ++format) {
+        for (int cn = 1; cn <= 4; ++cn) {
+            if (sui_ref_kernels[format][cn] == NULL) continue;
+            for (int k = 0; k < 70 + (int)(sizeof(widths) / sizeof(widths[0])); ++k) {
+                const int n = k < 70 ? k + 1 : widths[k - 70];
+                const int w = n + 3, h = 3, ws = w * cn + 1 + n % 3; // odd widths and strides
+                // exactly as large as needed, so a sanitizer sees reads past the last row
+                uint8_t *src = (uint8_t *)malloc(ws * (h - 1) + w * cn);
+                sui_image *img = sui_image_create(w, h, format);
+                sui_image *ref = sui_image_create(w, h, format);
+                uint32_t seed = 2166136261u ^ (uint32_t)(n * 16 + format * 4 + cn);
+                if (src == NULL || img == NULL || ref == NULL) {
+                    free(src); sui_image_destroy(&img); sui_image_destroy(&ref);
+                    return -1;
+                }
+                for (int i = 0; i < ws * (h - 1) + w * cn; ++i) {
+                    seed = seed * 1664525u + 1013904223u;
+                    src[i] = (uint8_t)(seed >> 24);
+                }
+                for (int x = 0; x <= 3; ++x) { // every alignment of the first pixel
+                    memset(img->imgdata, 0xA5, img->ws * h);
+                    memset(ref->imgdata, 0xA5, ref->ws * h);
+                    sui_image_copy(img, src, w, h, ws, cn, x, 1, n, h - 1);
+                    for (int i = 1; i < h; ++i) {
+                        sui_ref_kernels[format][cn](ref->imgdata + i * ref->ws + x * ref->bpp, src + i * ws + x * cn, n);
+                    }
+                    if (memcmp(img->imgdata, ref->imgdata, img->ws * h) != 0) ++failed;
                 }
-                pd += ws - w*3;
+                free(src);
+                sui_image_destroy(&img);
+                sui_image_destroy(&ref);
             }
         }
     }
-    return 0;
+    return failed;
 }
-#pragma GCC pop_options
     
 // FIXME(Hui): this table is only made for my laptop 
 static uint8_t keycode_to_ascii_lut[256] = {
@@ -176,233 +677,1163 @@ set_frameless_or_fullscreen(Display *dpy, Window win, int mode) {
     }
 }
 
+#define SUI_MAX_DAMAGE 16
+
+// a mouse event in OpenCV's convention, or a key press when type is SUI_KEY_EVENT
+typedef struct {
+    int type, x, y, flag;
+} sui_event;
+
+#define SUI_KEY_EVENT (-1)
+#define SUI_RING_SIZE 256 // power of 2
+
+/*
+ * The presenter thread owns the X connection. Frames are handed over through 
+ * a triple buffer: the producer fills slots[back], then swaps it with middle, 
+ * the presenter swaps front with middle when SUI_FRESH is set, so neither side
+ * ever waits and the newest frame wins. Input comes back through a single 
+ * producer single consumer ring. 
+ */
+#define SUI_FRESH 4
+
+typedef struct sui_presenter {
+    pthread_t thread;
+    int running;            // atomic 
+    sui_image *slots[3];
+    int back;               // owned by the producer 
+    int middle;             // atomic, slot index | SUI_FRESH
+    int front;              // owned by the presenter 
+    int frame_fd;           // eventfd, wakes the presenter on new frames or stop
+    int input_fd;           // eventfd, wakes sui_wait on new events 
+    sui_event ring[SUI_RING_SIZE];
+    unsigned head;          // atomic, written by the presenter only
+    unsigned tail;          // atomic, written by the ui thread only
+} sui_presenter;
+
+#define SUI_MAX_KEYS 32 // power of 2
+
+typedef struct SuiContext {
+    Display *display;
+    Visual *visual;
+    int depth, format;  // of the default visual, format is one of SUI_FORMAT_*
+    int has_render;     // XRender is there for scaling 
+    int use_shm;        // MIT-SHM extension is there, may still fail per window 
+    int shm_completion; // event type of ShmCompletion
+    struct Sui *windows; // all windows created in this context
+} SuiContext;
+
 typedef struct Sui {
-    int w, h, mode;   
+    int w, h, mode;     // w, h is the size of the framebuffer
+    int ww, wh;         // size of the window, differs from w, h when scaled 
+    int scaled;         // XRender scales the framebuffer to the window
+    int filter;         // SUI_FILTER_*
+    Pixmap pixmap;      // server side copy of the framebuffer when scaled
+    Picture src_pict, dst_pict;
     sui_callback cb;
     void *cb_dataptr;
     sui_image *img;
     XImage *ximg;
     Display *display;
     Visual *visual;
+    int depth, format;
     Window window;
-    XExposeEvent expose_event;
+    sui_rect damage[SUI_MAX_DAMAGE]; // exposed regions waiting for the last Expose
+    int ndamage;
+    int locked;         // the framebuffer is being written by the user 
+    int use_shm;        // MIT-SHM is available, img lives in shminfo's segment
+    int shm_completion; // event type of ShmCompletion
+    int shm_pending;    // number of XShmPutImage not completed yet
+    XShmSegmentInfo shminfo;
+    int motion, motion_x, motion_y; // latest pointer motion not delivered yet 
+    unsigned merged;    // atomic, motion events merged into a later one 
+    unsigned dropped;   // atomic, events lost because a queue was full 
+    int keys[SUI_MAX_KEYS]; // key presses in this window not returned by sui_wait yet
+    unsigned key_head, key_tail;
+    sui_presenter *presenter; // not NULL when presenting from a background thread
+    SuiContext *ctx;
+    int own_ctx;        // created by sui_create, destroyed with the window 
+    struct Sui *next;   // next window in the same context
 } Sui;
 
-static XExposeEvent
-sui_create_exposeevent(Sui *ui, int x, int y, int w, int h) {
-    XExposeEvent e;
-    e.type = Expose;
-    e.send_event = True;
-    e.display = ui->display;
-    e.window = ui->window;
-    e.x = x; e.y = y;
-    e.width = w;
-    e.height = h;
-    e.count = 0;
-    return e;
+static int sui_presenter_publish(Sui *ui, const uint8_t *imgdata, int w, int h, int ws, int cn);
+
+// clip r to (0, 0, w, h), return 0 if nothing left
+static int
+sui_clip_rect_to(sui_rect *r, int w, int h) {
+    int x0 = r->x < 0 ? 0 : r->x, y0 = r->y < 0 ? 0 : r->y;
+    int x1 = r->x + r->w, y1 = r->y + r->h;
+    if (x1 > w) x1 = w;
+    if (y1 > h) y1 = h;
+    if (x1 <= x0 || y1 <= y0) return 0;
+    r->x = x0; r->y = y0; r->w = x1 - x0; r->h = y1 - y0;
+    return 1;
 }
 
-Sui*
-sui_create(int w, int h, int mode) {
-    Display *display = NULL;
-    Visual *visual = NULL;
-    XImage *ximg = NULL;
-    Sui *ui = NULL;
-    Window window;
-    
-    ASSERT(w > 0 && h > 0);
+// clip r to the framebuffer, return 0 if nothing left
+static int
+sui_clip_rect(const Sui *ui, sui_rect *r) {
+    return sui_clip_rect_to(r, ui->w, ui->h);
+}
+
+static int
+sui_rect_touch(const sui_rect *a, const sui_rect *b) {
+    return a->x <= b->x + b->w && b->x <= a->x + a->w &&
+           a->y <= b->y + b->h && b->y <= a->y + a->h;
+}
+
+static void
+sui_rect_union(sui_rect *a, const sui_rect *b) {
+    const int x0 = a->x < b->x ? a->x : b->x, y0 = a->y < b->y ? a->y : b->y;
+    const int x1 = (a->x + a->w) > (b->x + b->w) ? (a->x + a->w) : (b->x + b->w);
+    const int y1 = (a->y + a->h) > (b->y + b->h) ? (a->y + a->h) : (b->y + b->h);
+    a->x = x0; a->y = y0; a->w = x1 - x0; a->h = y1 - y0;
+}
+
+/* 
+ * add a damaged region, overlapping or adjacent regions are merged, when the
+ * list is full everything collapses into the bounding box.
+ */
+static void
+sui_damage_add(Sui *ui, int x, int y, int w, int h) {
+    sui_rect r;
+    int i;
+    r.x = x; r.y = y; r.w = w; r.h = h;
+    if (!sui_clip_rect(ui, &r)) return;
     
-    display = XOpenDisplay(NULL);
-    if (display == NULL) {
-        goto cleanup;
+    for (i = 0; i < ui->ndamage;) {
+        if (sui_rect_touch(&r, &(ui->damage[i]))) {
+            sui_rect_union(&r, &(ui->damage[i]));
+            ui->damage[i] = ui->damage[--ui->ndamage];
+            i = 0; // the bigger one may touch the ones checked before
+        }
+        else ++i;
     }
     
-    visual = DefaultVisual(display, 0);    
-    if (visual == NULL) {
-        goto cleanup;
+    if (ui->ndamage == SUI_MAX_DAMAGE) {
+        for (i = 0; i < ui->ndamage; ++i) {
+            sui_rect_union(&r, &(ui->damage[i]));
+        }
+        ui->ndamage = 0;
     }
+    ui->damage[ui->ndamage++] = r;
+}
 
-    if(visual->class != TrueColor) {
-        goto cleanup;
+// set by sui_x_error_handler while probing requests that may fail (shm attach, pixmaps)
+static int sui_x_error = 0;
+
+static int
+sui_x_error_handler(Display *dpy, XErrorEvent *e) {
+    sui_x_error = 1;
+    return 0;
+}
+
+// the extension may still be unusable (e.g. ssh -X), which is found out when attaching
+static int
+sui_shm_available(Display *display) {
+    int major, minor;
+    Bool pixmaps;
+    if (!XShmQueryExtension(display)) return 0;
+    if (!XShmQueryVersion(display, &major, &minor, &pixmaps)) return 0;
+    return 1;
+}
+
+static XImage*
+sui_shm_create_ximage(Display *display, Visual *visual, int depth, int w, int h, XShmSegmentInfo *shminfo) {
+    XErrorHandler handler;
+    XImage *ximg = XShmCreateImage(display, visual, depth, ZPixmap, NULL, shminfo, w, h);
+    if (ximg == NULL) {
+        return NULL;
     }
     
-    // TODO(Hui): handle errors
-    window = XCreateSimpleWindow(display, RootWindow(display, 0), 0, 0, w, h, 1, 0, 0);
-    set_frameless_or_fullscreen(display, window, mode);
-    XSelectInput(display, window, PointerMotionMask|ButtonPressMask|ButtonReleaseMask|ExposureMask|KeyPressMask|KeyReleaseMask);
-    XMapWindow(display, window);
-        
-    ui = (Sui *)malloc(sizeof(*ui));
-    if (ui == NULL) {
-        XDestroyWindow(display, window);
-        goto cleanup;
+    shminfo->shmid = shmget(IPC_PRIVATE, ximg->bytes_per_line * ximg->height, IPC_CREAT | 0600);
+    if (shminfo->shmid < 0) {
+        XDestroyImage(ximg);
+        return NULL;
     }
-    else {
-        sui_image *img = sui_image_create(w, h);
-        if (img == NULL) {
-            goto cleanup;
-        }
-        
-        sui_image_set(img, 0x2C, 0x2C, 0x2C);
-        ximg = XCreateImage(display, visual, 24, ZPixmap, 0, (char *)img->imgdata, w, h, 32, 0);
-        if (ximg == NULL) {
-            sui_image_destroy(&img);
-            goto cleanup;
-        }
-        
-        ui->w = w; ui->h =h ; ui->mode = mode;
-        ui->cb = &sui_default_callback;
-        ui->cb_dataptr = NULL;
-        ui->img = img;                
-        ui->ximg = ximg;
-        ui->display = display;
-        ui->visual = visual;
-        ui->window = window;
-        ui->expose_event = sui_create_exposeevent(ui, 0, 0, w, h);
+    
+    shminfo->shmaddr = ximg->data = (char *)shmat(shminfo->shmid, NULL, 0);
+    shminfo->readOnly = False;
+    if (shminfo->shmaddr == (char *)-1) {
+        shmctl(shminfo->shmid, IPC_RMID, NULL);
+        ximg->data = NULL;
+        XDestroyImage(ximg);
+        return NULL;
     }
 
-    return ui;
+    // attaching fails with BadAccess on remote displays, catch it instead of exiting
+    sui_x_error = 0;
+    handler = XSetErrorHandler(sui_x_error_handler);
+    XShmAttach(display, shminfo);
+    XSync(display, False);
+    XSetErrorHandler(handler);
     
- cleanup:    
-    if (display) XCloseDisplay(display);
-    if (ximg) XDestroyImage(ximg);
-    return NULL;
+    // the segment will be released once both sides detached
+    shmctl(shminfo->shmid, IPC_RMID, NULL);
+    
+    if (sui_x_error) {
+        shmdt(shminfo->shmaddr);
+        ximg->data = NULL;
+        XDestroyImage(ximg);
+        return NULL;
+    }
+    return ximg;
 }
 
-int
-sui_destroy(Sui **pp) {
-    if (pp && *pp) {
-        Sui *p = *pp;
-        if (p->ximg) {
-            p->ximg->data = NULL; // the data belongs to ui->img
-            XDestroyImage(p->ximg);
-        }
-        if (p->display) {
-            XDestroyWindow(p->display, p->window);
-            XCloseDisplay(p->display);
-        }
-        if (p->img) sui_image_destroy(&(p->img));
-        *pp = NULL;
-        return 0;
-    }
-    return -1; 
+static void
+sui_shm_destroy_ximage(Display *display, XImage *ximg, XShmSegmentInfo *shminfo) {
+    XShmDetach(display, shminfo);
+    XSync(display, False);
+    ximg->data = NULL;
+    XDestroyImage(ximg);
+    shmdt(shminfo->shmaddr);
 }
 
-int
-sui_move(Sui *ui, int nx, int ny) {
-    if (ui && ui->mode == 0) {
-        XMoveWindow(ui->display, ui->window, nx, ny);
-        return 0;
+static Bool
+sui_is_shm_completion(Display *display, XEvent *e, XPointer arg) {
+    const Sui *ui = (const Sui *)arg;
+    const Drawable target = ui->scaled ? ui->pixmap : ui->window; // see sui_put_image
+    return e->type == ui->shm_completion && ((XShmCompletionEvent *)e)->drawable == target;
+}
+
+// block until the server finished reading the shared image, so we could write it
+static void
+sui_shm_wait(Sui *ui) {
+    XEvent event;
+    while (ui->shm_pending > 0) {
+        XIfEvent(ui->display, &event, sui_is_shm_completion, (XPointer)ui);
+        --ui->shm_pending;
     }
-    return -1;
 }
 
+/* 
+ * create the XImage and sui_image sharing the same pixels, in shared memory 
+ * if possible, fall back to normal client side memory.
+ */
+static int
+sui_create_images(Sui *ui, int w, int h, sui_image **pimg, XImage **pximg, XShmSegmentInfo *shminfo) {
+    sui_image *img = NULL;
+    XImage *ximg = NULL;
+    
+    if (ui->use_shm) {
+        ximg = sui_shm_create_ximage(ui->display, ui->visual, ui->depth, w, h, shminfo);
+        if (ximg) {
+            img = sui_image_wrap(w, h, ximg->bytes_per_line, ui->format, (uint8_t *)ximg->data);
+            if (img == NULL) {
+                sui_shm_destroy_ximage(ui->display, ximg, shminfo);
+                return -1;
+            }
+        }
+        else {
+            ui->use_shm = 0;
+        }
+    }
 
-int
-sui_resize(Sui *ui, int nw, int nh) {
-    if (ui == NULL || nw <=0 || nh <= 0) return -1;
-    if (ui->w == nw && ui->h == nh) return 0;
-    else { // recreate images 
-        XImage *ximg = NULL;
-        sui_image *img = sui_image_create(nw, nh);        
+    if (!ui->use_shm) {
+        img = sui_image_create(w, h, ui->format);
         if (img == NULL) {
             return -1;
         }
-        
-        sui_image_set(img, 0x2C, 0x2C, 0x2C);        
-        ximg = XCreateImage(ui->display, ui->visual, 24, ZPixmap, 0, (char *)img->imgdata, nw, nh, 32, 0);
-        
+        ximg = XCreateImage(ui->display, ui->visual, ui->depth, ZPixmap, 0, (char *)img->imgdata, w, h, 32, img->ws);
         if (ximg == NULL) {
             sui_image_destroy(&img);
             return -1;
         }
-
-        sui_image_destroy(&(ui->img));
-        ui->img = img;
-        ui->ximg->data = NULL;
-        XDestroyImage(ui->ximg);
-        ui->ximg = ximg;
-        ui->w = nw; ui->h = nh;
     }
     
-    XResizeWindow(ui->display, ui->window, nw, nh);
-    return 0;
-}
- 
-int
-sui_setcallback(Sui *p, void (* cb)(int, int, int, int, void *), void *dataptr) {
-    if (p == NULL) return -1;
-    p->cb = cb;
-    p->cb_dataptr = dataptr;
+    sui_image_set(img, 0x2C, 0x2C, 0x2C);
+    *pimg = img;
+    *pximg = ximg;
     return 0;
 }
-    
-int
+
+static void
+sui_destroy_images(Sui *ui, sui_image **pimg, XImage **pximg, XShmSegmentInfo *shminfo) {
+    if (*pximg) {
+        if (ui->use_shm) {
+            sui_shm_destroy_ximage(ui->display, *pximg, shminfo);
+        }
+        else {
+            (*pximg)->data = NULL; // the data belongs to img
+            XDestroyImage(*pximg);
+        }
+        *pximg = NULL;
+    }
+    sui_image_destroy(pimg);
+}
+
+static void
+sui_update_transform(Sui *ui) {
+    XTransform xf;
+    memset(&xf, 0, sizeof(xf));
+    xf.matrix[0][0] = XDoubleToFixed((double)ui->w / ui->ww);
+    xf.matrix[1][1] = XDoubleToFixed((double)ui->h / ui->wh);
+    xf.matrix[2][2] = XDoubleToFixed(1.0);
+    XRenderSetPictureTransform(ui->display, ui->src_pict, &xf);
+}
+
+static void
+sui_release_scaling(Sui *ui) {
+    if (ui->scaled) {
+        XRenderFreePicture(ui->display, ui->src_pict);
+        XRenderFreePicture(ui->display, ui->dst_pict);
+        XFreePixmap(ui->display, ui->pixmap);
+        ui->scaled = 0;
+    }
+}
+
+// upload into a pixmap of the framebuffer size, which XRender scales into the window
+static int
+sui_create_scaling(Sui *ui) {
+    XErrorHandler handler;
+    XRenderPictureAttributes pa;
+    XRenderPictFormat *fmt = XRenderFindVisualFormat(ui->display, ui->visual);
+    if (fmt == NULL) {
+        return -1;
+    }
+    
+    // e.g. BadAlloc for the pixmap, catch it instead of exiting
+    sui_x_error = 0;
+    handler = XSetErrorHandler(sui_x_error_handler);
+    pa.repeat = RepeatPad; // no black bleeding in at the borders 
+    ui->pixmap = XCreatePixmap(ui->display, ui->window, ui->w, ui->h, ui->depth);
+    XSync(ui->display, False);
+    if (!sui_x_error) {
+        ui->src_pict = XRenderCreatePicture(ui->display, ui->pixmap, fmt, CPRepeat, &pa);
+        ui->dst_pict = XRenderCreatePicture(ui->display, ui->window, fmt, 0, NULL);
+        XSync(ui->display, False);
+        if (sui_x_error) { // freeing the one that failed only raises another caught error
+            XRenderFreePicture(ui->display, ui->src_pict);
+            XRenderFreePicture(ui->display, ui->dst_pict);
+        }
+    }
+    if (sui_x_error) {
+        XFreePixmap(ui->display, ui->pixmap);
+        XSync(ui->display, False);
+        XSetErrorHandler(handler);
+        return -1;
+    }
+    XSetErrorHandler(handler);
+    
+    XRenderSetPictureFilter(ui->display, ui->src_pict, ui->filter == SUI_FILTER_NEAREST ? FilterNearest : FilterBilinear, NULL, 0);
+    ui->scaled = 1;
+    sui_update_transform(ui);
+    return 0;
+}
+
+// scale the region of the window from the pixmap 
+static void
+sui_composite(Sui *ui, int x, int y, int w, int h) {
+    XRenderComposite(ui->display, PictOpSrc, ui->src_pict, None, ui->dst_pict, x, y, 0, 0, x, y, w, h);
+}
+
+// region of the framebuffer to the region of the window it covers, a pixel more for filtering
+static int
+sui_scale_rect(const Sui *ui, sui_rect *r) {
+    int x0 = (int)((long)r->x * ui->ww / ui->w) - 1;
+    int y0 = (int)((long)r->y * ui->wh / ui->h) - 1;
+    int x1 = (int)(((long)(r->x + r->w) * ui->ww + ui->w - 1) / ui->w) + 1;
+    int y1 = (int)(((long)(r->y + r->h) * ui->wh + ui->h - 1) / ui->h) + 1;
+    r->x = x0; r->y = y0; r->w = x1 - x0; r->h = y1 - y0;
+    return sui_clip_rect_to(r, ui->ww, ui->wh);
+}
+
+// window coordinates to framebuffer coordinates 
+static void
+sui_map_pointer(const Sui *ui, int *x, int *y) {
+    if (ui->scaled) {
+        *x = (int)((long)*x * ui->w / ui->ww);
+        *y = (int)((long)*y * ui->h / ui->wh);
+    }
+}
+
+static void
+sui_put_image(Sui *ui, int x, int y, int w, int h) {
+    const Drawable target = ui->scaled ? ui->pixmap : ui->window;
+    if (ui->use_shm) {
+        XShmPutImage(ui->display, target, DefaultGC(ui->display, 0), ui->ximg, x, y, x, y, w, h, True);
+        ++ui->shm_pending;
+    }
+    else {
+        XPutImage(ui->display, target, DefaultGC(ui->display, 0), ui->ximg, x, y, x, y, w, h);
+    }
+    
+    if (ui->scaled) {
+        sui_rect r;
+        r.x = x; r.y = y; r.w = w; r.h = h;
+        if (sui_scale_rect(ui, &r)) sui_composite(ui, r.x, r.y, r.w, r.h);
+    }
+}
+
+/*
+ * find out how the pixels of the visual are stored, -1 if not supported. 
+ * The images are written in LSBFirst order, as on the machines we run on.
+ */
+static int
+sui_visual_format(Display *display, Visual *visual, int depth) {
+    XPixmapFormatValues *formats;
+    int i, n = 0, bpp = 0;
+    
+    if(visual->class != TrueColor || ImageByteOrder(display) != LSBFirst) {
+        return -1;
+    }
+    
+    formats = XListPixmapFormats(display, &n);
+    for (i = 0; formats && i < n; ++i) {
+        if (formats[i].depth == depth) bpp = formats[i].bits_per_pixel;
+    }
+    if (formats) XFree(formats);
+    
+    if (bpp == 32 && depth >= 24) {
+        if (visual->red_mask == 0xFF0000 && visual->green_mask == 0xFF00 && visual->blue_mask == 0xFF) {
+            return SUI_FORMAT_BGRX;
+        }
+        if (visual->red_mask == 0xFF && visual->green_mask == 0xFF00 && visual->blue_mask == 0xFF0000) {
+            return SUI_FORMAT_RGBX;
+        }
+    }
+    else if (bpp == 16 && depth == 16) {
+        if (visual->red_mask == 0xF800 && visual->green_mask == 0x7E0 && visual->blue_mask == 0x1F) {
+            return SUI_FORMAT_RGB565;
+        }
+    }
+    return -1;
+}
+
+SuiContext*
+sui_context_create(void) {
+    Display *display = NULL;
+    Visual *visual = NULL;
+    SuiContext *ctx = NULL;
+    int depth, format, render_event, render_error;
+    
+    sui_init_kernels();
+    display = XOpenDisplay(NULL);
+    if (display == NULL) {
+        goto cleanup;
+    }
+    
+    visual = DefaultVisual(display, 0);    
+    if (visual == NULL) {
+        goto cleanup;
+    }
+
+    depth = DefaultDepth(display, 0);
+    format = sui_visual_format(display, visual, depth);
+    if (format < 0) {
+        goto cleanup;
+    }
+    
+    ctx = (SuiContext *)malloc(sizeof(*ctx));
+    if (ctx == NULL) {
+        goto cleanup;
+    }
+    
+    ctx->display = display;
+    ctx->visual = visual;
+    ctx->depth = depth;
+    ctx->format = format;
+    ctx->has_render = XRenderQueryExtension(display, &render_event, &render_error);
+    ctx->use_shm = sui_shm_available(display);
+    ctx->shm_completion = ctx->use_shm ? XShmGetEventBase(display) + ShmCompletion : -1;
+    ctx->windows = NULL;
+    return ctx;
+    
+ cleanup:
+    if (display) XCloseDisplay(display);
+    return NULL;
+}
+
+int
+sui_context_destroy(SuiContext **pp) {
+    if (pp && *pp && (*pp)->windows == NULL) {
+        XCloseDisplay((*pp)->display);
+        free(*pp);
+        *pp = NULL;
+        return 0;
+    }
+    return -1;
+}
+
+Sui*
+sui_context_create_window(SuiContext *ctx, int w, int h, int mode) {
+    Display *display;
+    Sui *ui = NULL;
+    Window window;
+    
+    ASSERT(w > 0 && h > 0);
+    if (ctx == NULL) {
+        return NULL;
+    }
+    
+    ui = (Sui *)malloc(sizeof(*ui));
+    if (ui == NULL) {
+        return NULL;
+    }
+    
+    display = ctx->display;
+    ui->w = w; ui->h =h ; ui->mode = mode;
+    ui->ww = w; ui->wh = h;
+    ui->scaled = 0;
+    ui->filter = SUI_FILTER_BILINEAR;
+    ui->cb = &sui_default_callback;
+    ui->cb_dataptr = NULL;
+    ui->img = NULL;
+    ui->ximg = NULL;
+    ui->display = display;
+    ui->visual = ctx->visual;
+    ui->depth = ctx->depth;
+    ui->format = ctx->format;
+    ui->use_shm = ctx->use_shm;
+    ui->shm_completion = ctx->shm_completion;
+    ui->shm_pending = 0;
+    ui->motion = 0;
+    ui->merged = 0;
+    ui->dropped = 0;
+    ui->key_head = ui->key_tail = 0;
+    ui->presenter = NULL;
+    ui->ctx = ctx;
+    ui->own_ctx = 0;
+    
+    if (0 != sui_create_images(ui, w, h, &(ui->img), &(ui->ximg), &(ui->shminfo))) {
+        free(ui);
+        return NULL;
+    }
+    
+    // TODO(Hui): handle errors
+    window = XCreateSimpleWindow(display, RootWindow(display, 0), 0, 0, w, h, 1, 0, 0);
+    set_frameless_or_fullscreen(display, window, mode);
+    XSelectInput(display, window, PointerMotionMask|ButtonPressMask|ButtonReleaseMask|ExposureMask|KeyPressMask|KeyReleaseMask|StructureNotifyMask);
+    XMapWindow(display, window);
+    
+    ui->window = window;
+    ui->ndamage = 0;
+    ui->locked = 0;
+    ui->next = ctx->windows;
+    ctx->windows = ui;
+    return ui;
+}
+
+Sui*
+sui_create(int w, int h, int mode) {
+    Sui *ui = NULL;
+    SuiContext *ctx = sui_context_create();
+    if (ctx == NULL) {
+        return NULL;
+    }
+    
+    ui = sui_context_create_window(ctx, w, h, mode);
+    if (ui == NULL) {
+        sui_context_destroy(&ctx);
+        return NULL;
+    }
+    ui->own_ctx = 1;
+    return ui;
+}
+
+int
+sui_destroy(Sui **pp) {
+    if (pp && *pp) {
+        Sui *p = *pp, **link;
+        sui_stop_presenter(p);
+        sui_release_scaling(p);
+        sui_destroy_images(p, &(p->img), &(p->ximg), &(p->shminfo));
+        XDestroyWindow(p->display, p->window);
+        for (link = &(p->ctx->windows); *link; link = &((*link)->next)) {
+            if (*link == p) {
+                *link = p->next;
+                break;
+            }
+        }
+        if (p->own_ctx) {
+            sui_context_destroy(&(p->ctx));
+        }
+        else {
+            XFlush(p->display);
+        }
+        free(p);
+        *pp = NULL;
+        return 0;
+    }
+    return -1; 
+}
+
+int
+sui_move(Sui *ui, int nx, int ny) {
+    if (ui && ui->mode == 0 && ui->presenter == NULL) {
+        XMoveWindow(ui->display, ui->window, nx, ny);
+        return 0;
+    }
+    return -1;
+}
+
+
+// recreate the framebuffer with a new size 
+static int
+sui_recreate_images(Sui *ui, int nw, int nh) {
+    XImage *ximg = NULL;
+    sui_image *img = NULL;
+    XShmSegmentInfo shminfo;
+    const int old_shm = ui->use_shm;
+    int new_shm;
+    
+    if (0 != sui_create_images(ui, nw, nh, &img, &ximg, &shminfo)) {
+        ui->use_shm = old_shm; // still true of the images kept
+        return -1;
+    }
+    
+    // the server may still be reading the old segment 
+    sui_shm_wait(ui);
+    new_shm = ui->use_shm; // may have fallen back to XPutImage
+    ui->use_shm = old_shm;
+    sui_destroy_images(ui, &(ui->img), &(ui->ximg), &(ui->shminfo));
+    ui->use_shm = new_shm;
+    
+    ui->img = img;
+    ui->ximg = ximg;
+    ui->shminfo = shminfo;
+    ui->w = nw; ui->h = nh;
+    ui->ndamage = 0;
+    return 0;
+}
+
+int
+sui_resize(Sui *ui, int nw, int nh) {
+    if (ui == NULL || nw <=0 || nh <= 0) return -1;
+    if (ui->ww == nw && ui->wh == nh && (ui->scaled || (ui->w == nw && ui->h == nh))) return 0;
+    else if (ui->locked || ui->presenter) return -1; // the framebuffer is in use
+    else if (ui->scaled) { // the framebuffer keeps its size, only scaled differently
+        ui->ww = nw; ui->wh = nh;
+        sui_update_transform(ui);
+    }
+    else {
+        // the window manager may have resized the window already, not the framebuffer
+        if ((ui->w != nw || ui->h != nh) && 0 != sui_recreate_images(ui, nw, nh)) {
+            return -1;
+        }
+        ui->ww = nw; ui->wh = nh;
+    }
+    
+    XResizeWindow(ui->display, ui->window, nw, nh);
+    return 0;
+}
+
+int
+sui_set_logical_size(Sui *ui, int lw, int lh, int filter) {
+    if (ui == NULL || lw <= 0 || lh <= 0 || ui->locked || ui->presenter) return -1;
+    if (!ui->ctx->has_render && (lw != ui->ww || lh != ui->wh)) return -1;
+    
+    sui_shm_wait(ui);
+    sui_release_scaling(ui);
+    ui->filter = filter;
+    if ((lw == ui->w && lh == ui->h) || 0 == sui_recreate_images(ui, lw, lh)) {
+        if (lw == ui->ww && lh == ui->wh) { // same as the window, nothing to scale
+            return 0;
+        }
+        if (0 == sui_create_scaling(ui)) {
+            return 0;
+        }
+    }
+    // back to a framebuffer of the window size, unscaled
+    if (ui->w != ui->ww || ui->h != ui->wh) {
+        sui_recreate_images(ui, ui->ww, ui->wh);
+    }
+    return -1;
+}
+
+int
+sui_get_size(Sui *ui, int *w, int *h) {
+    if (ui == NULL) return -1;
+    if (w) *w = ui->w;
+    if (h) *h = ui->h;
+    return 0;
+}
+ 
+int
+sui_setcallback(Sui *p, void (* cb)(int, int, int, int, void *), void *dataptr) {
+    if (p == NULL) return -1;
+    p->cb = cb;
+    p->cb_dataptr = dataptr;
+    return 0;
+}
+    
+int
 sui_show(Sui *ui, const unsigned char *imgdata, int w, int h, int ws, int cn) {
+    sui_rect r;
+    r.x = 0; r.y = 0; r.w = w; r.h = h;
+    return sui_show_rects(ui, imgdata, w, h, ws, cn, &r, 1);
+}
+
+int
+sui_show_rects(Sui *ui, const unsigned char *imgdata, int w, int h, int ws, int cn, const sui_rect *rects, int n) {
     if (ui == NULL || ui->img == NULL) return -1;    
-    if (imgdata && w > 0 && h > 0 && ws > 0 && cn > 0) {
-        if (ui->img->w != w || ui->img->h != h) {
-            return -1;
+    if (imgdata && w > 0 && h > 0 && ws > 0 && cn > 0 && rects && n >= 0) {
+        sui_rect r;
+        int i;
+        
+        if (ui->presenter) { // the slots are reused, so always hand over whole frames
+            return sui_presenter_publish(ui, imgdata, w, h, ws, cn);
         }
         
-        if (0 == sui_image_copy(ui->img, imgdata, w, h, ws, cn)) {
-            XSendEvent(ui->display, ui->window, False, 0, (XEvent*)&(ui->expose_event));
-            return 0;
+        // an image of a different size only updates the overlapping part 
+        if (imgdata == ui->img->imgdata) { // drawn into the framebuffer directly
+            if (ws != ui->img->ws || cn != ui->img->bpp) {
+                return -1;
+            }
         }
         else {
-            return -1;
+            sui_shm_wait(ui); // the server must be done with the shared image 
+            for (i = 0; i < n; ++i) {
+                r = rects[i];
+                if (!sui_clip_rect(ui, &r) || !sui_clip_rect_to(&r, w, h)) continue;
+                if (0 != sui_image_copy(ui->img, imgdata, w, h, ws, cn, r.x, r.y, r.w, r.h)) {
+                    return -1;
+                }
+            }
         }
+        
+        // present directly, no need to go through the event queue
+        for (i = 0; i < n; ++i) {
+            r = rects[i];
+            if (sui_clip_rect(ui, &r) && sui_clip_rect_to(&r, w, h)) sui_put_image(ui, r.x, r.y, r.w, r.h);
+        }
+        XFlush(ui->display);
+        return 0;
     }
     // TODO(Hui): do nothing, return meaningful codes ?
     return -1;
 }
 
 int
-sui_wait(Sui *ui, int ms) {
-    const int start_time = getticks();
-    int is_press = 0;
+sui_lock_framebuffer(Sui *ui, unsigned char **data, int *w, int *h, int *ws, int *format) {
+    if (ui == NULL || ui->img == NULL || data == NULL || ui->presenter) return -1;
+    sui_shm_wait(ui); // the server must be done with the shared image
+    ui->locked = 1;
+    *data = ui->img->imgdata;
+    if (w) *w = ui->img->w;
+    if (h) *h = ui->img->h;
+    if (ws) *ws = ui->img->ws;
+    if (format) *format = ui->img->format;
+    return 0;
+}
+
+int
+sui_unlock_framebuffer(Sui *ui) {
+    if (ui == NULL || !ui->locked) return -1;
+    ui->locked = 0;
+    return 0;
+}
+
+static void
+sui_ring_push(Sui *ui, int type, int x, int y, int flag) {
+    sui_presenter *p = ui->presenter;
+    const unsigned head = p->head;
+    if (head - __atomic_load_n(&(p->tail), __ATOMIC_ACQUIRE) == SUI_RING_SIZE) {
+        __atomic_fetch_add(&(ui->dropped), 1, __ATOMIC_RELAXED);
+        return;
+    }
+    p->ring[head & (SUI_RING_SIZE - 1)].type = type;
+    p->ring[head & (SUI_RING_SIZE - 1)].x = x;
+    p->ring[head & (SUI_RING_SIZE - 1)].y = y;
+    p->ring[head & (SUI_RING_SIZE - 1)].flag = flag;
+    __atomic_store_n(&(p->head), head + 1, __ATOMIC_RELEASE);
+}
+
+static int
+sui_ring_pop(sui_presenter *p, sui_event *e) {
+    const unsigned tail = p->tail;
+    if (tail == __atomic_load_n(&(p->head), __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    *e = p->ring[tail & (SUI_RING_SIZE - 1)];
+    __atomic_store_n(&(p->tail), tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// deliver a mouse event, queued for the ui thread when presenting in background
+static void
+sui_emit(Sui *ui, int type, int x, int y, int flag) {
+    if (ui->presenter) sui_ring_push(ui, type, x, y, flag);
+    else ui->cb(type, x, y, flag, ui->cb_dataptr);
+}
+
+// deliver the motion held back, called before other mouse events to keep the order
+static void
+sui_flush_motion(Sui *ui) {
+    if (ui->motion) {
+        ui->motion = 0;
+        sui_emit(ui, 0, ui->motion_x, ui->motion_y, 0);
+    }
+}
+
+// consecutive motions only matter by their latest position 
+static void
+sui_merge_motion(Sui *ui, int x, int y) {
+    if (ui->motion) __atomic_fetch_add(&(ui->merged), 1, __ATOMIC_RELAXED);
+    ui->motion = 1;
+    ui->motion_x = x;
+    ui->motion_y = y;
+}
+
+static void
+sui_push_key(Sui *ui, int key) {
+    if (ui->key_head - ui->key_tail == SUI_MAX_KEYS) {
+        __atomic_fetch_add(&(ui->dropped), 1, __ATOMIC_RELAXED);
+        return;
+    }
+    ui->keys[ui->key_head++ & (SUI_MAX_KEYS - 1)] = key;
+}
+
+// the oldest key of ui not returned yet, -1 if none
+static int
+sui_pop_key(Sui *ui) {
+    if (ui->key_head == ui->key_tail) return -1;
+    return ui->keys[ui->key_tail++ & (SUI_MAX_KEYS - 1)];
+}
+
+static void
+sui_notify(int fd) {
+    const uint64_t one = 1;
+    ssize_t r = write(fd, &one, sizeof(one)); // only fails when the counter is saturated
+    (void)r;
+}
+
+// convert the frame into the back slot and hand it over, never blocks 
+static int
+sui_presenter_publish(Sui *ui, const uint8_t *imgdata, int w, int h, int ws, int cn) {
+    sui_presenter *p = ui->presenter;
+    sui_image *slot = p->slots[p->back];
+    const int cw = w < slot->w ? w : slot->w, ch = h < slot->h ? h : slot->h;
+    
+    if (0 != sui_image_copy(slot, imgdata, w, h, ws, cn, 0, 0, cw, ch)) {
+        return -1;
+    }
+    p->back = __atomic_exchange_n(&(p->middle), p->back | SUI_FRESH, __ATOMIC_ACQ_REL) & 3;
+    sui_notify(p->frame_fd);
+    return 0;
+}
+
+static void
+sui_presenter_present(Sui *ui) {
+    sui_presenter *p = ui->presenter;
+    sui_image *slot;
+    if (!(__atomic_load_n(&(p->middle), __ATOMIC_ACQUIRE) & SUI_FRESH)) {
+        return;
+    }
+    
+    p->front = __atomic_exchange_n(&(p->middle), p->front, __ATOMIC_ACQ_REL) & 3;
+    slot = p->slots[p->front];
+    if (ui->use_shm) { // the segment can not be swapped, copy into it 
+        sui_shm_wait(ui);
+        sui_image_blit(ui->img, slot);
+    }
+    else {
+        ui->ximg->data = (char *)slot->imgdata;
+    }
+    sui_put_image(ui, 0, 0, ui->w, ui->h);
+    XFlush(ui->display);
+}
+
+static int sui_handle_event(Sui *ui, XEvent *event);
+
+static void*
+sui_presenter_main(void *arg) {
+    Sui *ui = (Sui *)arg;
+    sui_presenter *p = ui->presenter;
+    struct pollfd pfd[2];
     XEvent event;
+    uint64_t v;
     
-    if (ui == NULL) {
+    pfd[0].fd = ConnectionNumber(ui->display);
+    pfd[0].events = POLLIN;
+    pfd[1].fd = p->frame_fd;
+    pfd[1].events = POLLIN;
+    
+    while (__atomic_load_n(&(p->running), __ATOMIC_ACQUIRE)) {
+        const unsigned head = p->head;
+        while (XPending(ui->display)) {
+            int key;
+            XNextEvent(ui->display, &event);
+            key = sui_handle_event(ui, &event);
+            if (key >= 0) sui_ring_push(ui, SUI_KEY_EVENT, key, 0, 0);
+        }
+        sui_flush_motion(ui);
+        if (head != p->head) sui_notify(p->input_fd);
+        
+        sui_presenter_present(ui);
+        if (XQLength(ui->display) > 0) continue; // read while waiting for ShmCompletion
+        
+        if (poll(pfd, 2, -1) > 0 && (pfd[1].revents & POLLIN)) {
+            ssize_t r = read(p->frame_fd, &v, sizeof(v));
+            (void)r;
+        }
+    }
+    return NULL;
+}
+
+// sui_wait of the ui thread, events come from the ring
+static int
+sui_presenter_wait(Sui *ui, int ms) {
+    const int start_time = getticks();
+    sui_presenter *p = ui->presenter;
+    struct pollfd pfd;
+    sui_event e;
+    uint64_t v;
+    
+    pfd.fd = p->input_fd;
+    pfd.events = POLLIN;
+    
+    for (;;) {
+        int timeout = -1;
+        ssize_t r = read(p->input_fd, &v, sizeof(v)); // reset before draining, no wakeup gets lost
+        (void)r;
+        while (sui_ring_pop(p, &e)) {
+            if (e.type == SUI_KEY_EVENT) return e.x; // the rest stays queued for the next call 
+            ui->cb(e.type, e.x, e.y, e.flag, ui->cb_dataptr);
+        }
+        
+        if (ms > 0) {
+            timeout = ms - (getticks() - start_time);
+            if (timeout <= 0) break;
+        }
+        
+        if (poll(&pfd, 1, timeout) < 0 && errno != EINTR) {
+            return -1;
+        }
+    }
+    return -1; // no key in time
+}
+
+int
+sui_start_presenter(Sui *ui) {
+    sui_presenter *p;
+    int i;
+    
+    if (ui == NULL || ui->presenter || ui->locked || !ui->own_ctx) {
+        return -1;
+    }
+    
+    p = (sui_presenter *)calloc(1, sizeof(*p));
+    if (p == NULL) {
+        return -1;
+    }
+    
+    p->frame_fd = eventfd(0, EFD_NONBLOCK);
+    p->input_fd = eventfd(0, EFD_NONBLOCK);
+    for (i = 0; i < 3; ++i) {
+        p->slots[i] = sui_image_create(ui->w, ui->h, ui->format);
+        if (p->slots[i]) sui_image_blit(p->slots[i], ui->img);
+    }
+    p->back = 0; p->middle = 1; p->front = 2;
+    p->running = 1;
+    
+    if (p->frame_fd < 0 || p->input_fd < 0 || !p->slots[0] || !p->slots[1] || !p->slots[2]) {
+        goto cleanup;
+    }
+    
+    XFlush(ui->display);
+    ui->presenter = p;
+    if (0 != pthread_create(&(p->thread), NULL, sui_presenter_main, ui)) {
+        ui->presenter = NULL;
+        goto cleanup;
+    }
+    return 0;
+    
+ cleanup:
+    if (p->frame_fd >= 0) close(p->frame_fd);
+    if (p->input_fd >= 0) close(p->input_fd);
+    for (i = 0; i < 3; ++i) sui_image_destroy(&(p->slots[i]));
+    free(p);
+    return -1;
+}
+
+int
+sui_stop_presenter(Sui *ui) {
+    sui_presenter *p;
+    sui_event e;
+    int i;
+    
+    if (ui == NULL || ui->presenter == NULL) {
         return -1;
     }
+    
+    p = ui->presenter;
+    __atomic_store_n(&(p->running), 0, __ATOMIC_RELEASE);
+    sui_notify(p->frame_fd);
+    pthread_join(p->thread, NULL);
+    
+    // keep the last presented frame for later exposures 
+    if (!ui->use_shm) {
+        ui->ximg->data = (char *)ui->img->imgdata;
+        sui_image_blit(ui->img, p->slots[p->front]);
+    }
+    
+    // events not taken by sui_wait yet still go to the callback 
+    while (sui_ring_pop(p, &e)) {
+        if (e.type != SUI_KEY_EVENT) ui->cb(e.type, e.x, e.y, e.flag, ui->cb_dataptr);
+    }
+    
+    ui->presenter = NULL;
+    close(p->frame_fd);
+    close(p->input_fd);
+    for (i = 0; i < 3; ++i) sui_image_destroy(&(p->slots[i]));
+    free(p);
+    return 0;
+}
+
+// handle one event, return the ascii code if it's a key press, else -1 
+static int
+sui_handle_event(Sui *ui, XEvent *event) {
+    switch(event->type) {
+    case Expose:
+        if (ui->scaled) { // the pixmap is up to date, let the server scale it again
+            sui_rect r;
+            r.x = event->xexpose.x; r.y = event->xexpose.y; r.w = event->xexpose.width; r.h = event->xexpose.height;
+            if (sui_clip_rect_to(&r, ui->ww, ui->wh)) sui_composite(ui, r.x, r.y, r.w, r.h);
+            break;
+        }
+        sui_damage_add(ui, event->xexpose.x, event->xexpose.y, event->xexpose.width, event->xexpose.height);
+        if (event->xexpose.count == 0) { // the last one of this series
+            for (int i = 0; i < ui->ndamage; ++i) {
+                const sui_rect *r = &(ui->damage[i]);
+                sui_put_image(ui, r->x, r->y, r->w, r->h);
+            }
+            ui->ndamage = 0;
+        }
+        break;
+    case ButtonPress:
+    case ButtonRelease:                
+        { 
+            int cvetype = 0, flag = 0;
+            int x = event->xbutton.x;
+            int y = event->xbutton.y;                    
+            const int is_press = event->type == ButtonPress ? 1 : 0;
+            switch(event->xbutton.button) {
+            case Button1: flag = 1; cvetype = is_press ? 1 : 4; break;
+            case Button3: flag = 2; cvetype = is_press ? 2 : 5; break;
+            case Button2: flag = 4; cvetype = is_press ? 3 : 6; break;
+            }
+            sui_map_pointer(ui, &x, &y);
+            sui_flush_motion(ui);
+            sui_emit(ui, cvetype, x, y, flag);
+        }
+        break;            
+    case MotionNotify: // mouse motion
+        {
+            int x = event->xmotion.x, y = event->xmotion.y;
+            sui_map_pointer(ui, &x, &y);
+            sui_merge_motion(ui, x, y);
+        }
+        break;
+    case ConfigureNotify: // e.g. the window manager made it full screen
+        if (event->xconfigure.width != ui->ww || event->xconfigure.height != ui->wh) {
+            ui->ww = event->xconfigure.width;
+            ui->wh = event->xconfigure.height;
+            if (ui->scaled) sui_update_transform(ui);
+        }
+        break;            
+    case KeyPress:
+        return keycode_to_ascii(event->xkey.keycode);
+    default:
+        if (event->type == ui->shm_completion) {
+            if (ui->shm_pending > 0) --ui->shm_pending;
+        }
+        break;
+    }
+    return -1;
+}
+
+static Sui*
+sui_context_find(SuiContext *ctx, Window window) {
+    Sui *ui;
+    for (ui = ctx->windows; ui; ui = ui->next) {
+        if (ui->window == window) return ui;
+        if (ui->scaled && ui->pixmap == window) return ui; // ShmCompletion of a scaled upload
+    }
+    return NULL;
+}
 
+/*
+ * handle the events of all windows in ctx for up to ms, return a key of only,
+ * or of any window when only is NULL; the keys of the others stay queued
+ */
+static int
+sui_context_run(SuiContext *ctx, Sui *only, int ms) {
+    const int start_time = getticks();
+    struct pollfd pfd;
+    XEvent event;
+    
+    if (ctx->windows && ctx->windows->presenter) { // the connection belongs to the presenter thread
+        return sui_presenter_wait(ctx->windows, ms);
+    }
+
+    pfd.fd = ConnectionNumber(ctx->display);
+    pfd.events = POLLIN;
+    
     for (;;) {
-        if (ms > 0 && (getticks() - start_time > ms)) break;        
-        usleep(2000); // sleep 2 ms        
-        // handle event only when there is
-        if (XPending(ui->display)) {
-            XNextEvent(ui->display, &event);            
-            switch(event.type) {
-            case Expose:
-                XPutImage(ui->display, ui->window, DefaultGC(ui->display, 0), ui->ximg, 0, 0, 0, 0, ui->w, ui->h);
-                break;
-            case ButtonPress:
-            case ButtonRelease:                
-                { 
-                    int cvetype = 0, flag = 0;
-                    const int x = event.xbutton.x;
-                    const int y = event.xbutton.y;                    
-                    is_press = event.type == ButtonPress ? 1 : 0;
-                    switch(event.xbutton.button) {
-                    case Button1: flag = 1; cvetype = is_press ? 1 : 4; break;
-                    case Button3: flag = 2; cvetype = is_press ? 2 : 5; break;
-                    case Button2: flag = 4; cvetype = is_press ? 3 : 6; break;
-                    }
-                    ui->cb(cvetype, x, y, flag, ui->cb_dataptr);
-                }
-                break;            
-            case MotionNotify: // mouse motion
-                ui->cb(0, event.xbutton.x, event.xbutton.y, 0, ui->cb_dataptr);
-                break;            
-            case KeyPress:
-                return keycode_to_ascii(event.xkey.keycode);
+        int timeout = -1;
+        Sui *ui;
+        // drain everything already received, XPending also flushes our requests
+        while (XPending(ctx->display)) {
+            XNextEvent(ctx->display, &event);
+            ui = sui_context_find(ctx, event.xany.window);
+            if (ui) {
+                const int k = sui_handle_event(ui, &event);
+                if (k >= 0) sui_push_key(ui, k);
+            }
+        }
+        for (ui = ctx->windows; ui; ui = ui->next) {
+            sui_flush_motion(ui);
+        }
+        
+        // one key per call, the others wait for the next calls 
+        if (only) {
+            const int k = sui_pop_key(only);
+            if (k >= 0) return k;
+        }
+        else {
+            for (ui = ctx->windows; ui; ui = ui->next) {
+                const int k = sui_pop_key(ui);
+                if (k >= 0) return k;
             }
         }
+        
+        if (ms > 0) {
+            timeout = ms - (getticks() - start_time);
+            if (timeout <= 0) break;
+        }
+        
+        // sleep until the server sends something or time is up
+        if (poll(&pfd, 1, timeout) < 0 && errno != EINTR) {
+            return -1;
+        }
     }
+    return -1; // no key in time
+}
+
+int
+sui_event_stats(Sui *ui, unsigned *merged, unsigned *dropped) {
+    if (ui == NULL) return -1;
+    if (merged) *merged = __atomic_load_n(&(ui->merged), __ATOMIC_RELAXED);
+    if (dropped) *dropped = __atomic_load_n(&(ui->dropped), __ATOMIC_RELAXED);
     return 0;
 }
 
+int
+sui_context_wait(SuiContext *ctx, int ms) {
+    if (ctx == NULL) {
+        return -1;
+    }
+    return sui_context_run(ctx, NULL, ms);
+}
+
+int
+sui_wait(Sui *ui, int ms) {
+    if (ui == NULL) {
+        return -1;
+    }
+    return sui_context_run(ui->ctx, ui, ms);
+}
+
 #ifdef __cplusplus
 }
 #endif 
@@ -34,9 +34,21 @@ extern "C" {
 #endif 
 
 typedef struct Sui Sui;
+typedef struct SuiContext SuiContext;
+
+/**
+ *  \brief a rectangle region in window coordinates 
+ */
+typedef struct sui_rect {
+    int x, y, w, h;
+} sui_rect;
+
 /**
  *  \brief create a Sui object
  *
+ *  the window has its own display connection, which is closed by sui_destroy.
+ *  The default visual must be TrueColor, 24/32 bits BGRX/RGBX or 16 bits RGB565.
+ *
  *  \param w width of the window
  *  \param h height of the window
  *  \param mode 1 --> full screen or 0 --> not full screen 
@@ -44,6 +56,46 @@ typedef struct Sui Sui;
  */
 Sui* sui_create(int w, int h, int mode);
 
+/**
+ *  \brief create a context owning one X display connection 
+ *
+ *  All windows created in the same context share the connection, and are 
+ *  served by one event loop, see sui_context_wait.
+ *
+ *  \return return valid pointer or NULL
+ */
+SuiContext* sui_context_create(void);
+
+/**
+ *  \brief create a window in a context 
+ *
+ *  \param ctx valid context pointer
+ *  \param w width of the window
+ *  \param h height of the window
+ *  \param mode 1 --> full screen or 0 --> not full screen 
+ *  \return return valid pointer or NULL, release it with sui_destroy
+ */
+Sui* sui_context_create_window(SuiContext *ctx, int w, int h, int mode);
+
+/**
+ *  \brief wait certen ms while handling events of all windows in the context
+ *
+ *  each event goes to the callback of its window, same behavior as sui_wait.
+ *  Keys of any window are returned, each window keeps its own queue of them.
+ *
+ *  \param ctx a valid pointer, if it's NULL, will do nothing 
+ *  \return return ascii code of the key during the waiting, else -1
+ */
+int  sui_context_wait(SuiContext *ctx, int ms);
+
+/**
+ *  \brief release the context, set the pointer to zero 
+ *
+ *  \param pp pointer to a valid pointer, all its windows must be destroyed before
+ *  \return return 0 if OK, else -1
+ */
+int  sui_context_destroy(SuiContext **pp);
+
 /**
  *  \brief move window to a new position relative to the root window 
  *
@@ -57,6 +109,8 @@ int  sui_move(Sui *ui, int nx, int ny);
 /**
  *  \brief resize window
  *
+ *  without a logical size the framebuffer gets the new size too
+ *
  *  \param ui a valid pointer, if it's NULL, will do nothing
  *  \param nw new window width
  *  \param nh new window height 
@@ -64,6 +118,42 @@ int  sui_move(Sui *ui, int nx, int ny);
  */
 int sui_resize(Sui *ui, int nw, int nh);
     
+/**
+ *  \brief filters used when the framebuffer is scaled to the window 
+ */
+enum {
+    SUI_FILTER_NEAREST  = 0,
+    SUI_FILTER_BILINEAR = 1
+};
+
+/**
+ *  \brief draw at a logical size, the X server scales it to the window
+ *
+ *  The framebuffer becomes lw x lh, images passed to sui_show should have 
+ *  this size, the X server scales it to the window with XRender. Mouse 
+ *  coordinates are mapped back to the logical size. Using the window size 
+ *  turns scaling off.
+ *
+ *  \param ui a valid pointer, if it's NULL, will do nothing
+ *  \param lw logical width
+ *  \param lh logical height
+ *  \param filter one of SUI_FILTER_*
+ *  \return return 0 if OK, -1 if XRender is not available or on errors; when
+ *  it fails after the checks, the framebuffer is the window size, unscaled, 
+ *  see sui_get_size
+ */
+int sui_set_logical_size(Sui *ui, int lw, int lh, int filter);
+
+/**
+ *  \brief size of the framebuffer, the logical size when scaled
+ *
+ *  \param ui a valid pointer, if it's NULL, will do nothing
+ *  \param w returns the width, could be NULL
+ *  \param h returns the height, could be NULL
+ *  \return return 0 if OK, else -1
+ */
+int sui_get_size(Sui *ui, int *w, int *h);
+
 /**
  *  \brief sui callback function type
  *
@@ -88,7 +178,8 @@ int  sui_setcallback(Sui *ui, void (* cb)(int, int, int, int, void *), void *d);
 /**
  *  \brief display the window 
  *
- *  send the image for displaying 
+ *  send the image for displaying, if the size of the image is different from
+ *  the window, only the overlapping part will be updated.
  *
  *  \param ui valid pointer, if it's NULL, will do nothing
  *  \param imgdata pointer to the real image data
@@ -100,16 +191,117 @@ int  sui_setcallback(Sui *ui, void (* cb)(int, int, int, int, void *), void *d);
  */
 int  sui_show(Sui *ui, const unsigned char *imgdata, int w, int h, int ws, int cn);
 
+/**
+ *  \brief display only some regions of the image 
+ *
+ *  same as sui_show, but only the listed regions are converted and sent
+ *  to the X server, regions outside the window are clipped.
+ *
+ *  \param ui valid pointer, if it's NULL, will do nothing
+ *  \param imgdata pointer to the real image data
+ *  \param w width of the image
+ *  \param height of the image
+ *  \param ws widthstep of the image
+ *  \param cn number of channels of the image 
+ *  \param rects regions to be updated 
+ *  \param n number of regions 
+ *  \return return 0 if OK, else -1
+ */
+int  sui_show_rects(Sui *ui, const unsigned char *imgdata, int w, int h, int ws, int cn, const sui_rect *rects, int n);
+
+/**
+ *  \brief pixel formats of the framebuffer 
+ */
+enum {
+    SUI_FORMAT_BGRX   = 0, /* 4 bytes per pixel: blue, green, red, unused */
+    SUI_FORMAT_RGBX   = 1, /* 4 bytes per pixel: red, green, blue, unused */
+    SUI_FORMAT_RGB565 = 2  /* 2 bytes per pixel: 5 bits red, 6 bits green, 5 bits blue */
+};
+
+/**
+ *  \brief get the window's framebuffer to draw into it directly
+ *
+ *  The buffer stays valid until the window is resized or destroyed. Write into 
+ *  it only while locked, then unlock and present it with sui_show/sui_show_rects 
+ *  with imgdata pointing to the buffer, which will not copy anything.
+ *
+ *  \param ui valid pointer, if it's NULL, will do nothing
+ *  \param data returns pointer to the first pixel
+ *  \param w returns width of the framebuffer, could be NULL
+ *  \param h returns height of the framebuffer, could be NULL
+ *  \param ws returns widthstep of the framebuffer in bytes, could be NULL
+ *  \param format returns pixel format, one of SUI_FORMAT_*, could be NULL
+ *  \return return 0 if OK, else -1
+ */
+int  sui_lock_framebuffer(Sui *ui, unsigned char **data, int *w, int *h, int *ws, int *format);
+
+/**
+ *  \brief done with writing the framebuffer 
+ *
+ *  \param ui valid pointer, if it's NULL, will do nothing
+ *  \return return 0 if OK, else -1
+ */
+int  sui_unlock_framebuffer(Sui *ui);
+
 /**
  *  \brief wait certen ms while handling each event 
  *
- *  if ms <= 0, it will return immediately after the first key event, else wait
+ *  if ms <= 0, it will return immediately after the first key event, else wait.
+ *  It sleeps on the X connection, all queued events are handled on each wakeup.
+ *  Consecutive mouse motions are merged into the latest one, other mouse events
+ *  keep their order. Keys are queued, each call returns at most one of them.
+ *  Windows in a shared context are all served, same as sui_context_wait, but
+ *  only the keys typed into ui are returned, the others wait for their window.
  *
  *  \param ui a valid pointer, if it's NULL, will do nothing 
  *  \return return ascii code of the key during the waiting, else -1
  */
 int  sui_wait(Sui *ui, int ms);
 
+/**
+ *  \brief counters of the event handling, for tuning 
+ *
+ *  \param ui valid pointer, if it's NULL, will do nothing
+ *  \param merged returns number of motion events merged into a later one, could be NULL
+ *  \param dropped returns number of events lost because a queue was full, could be NULL
+ *  \return return 0 if OK, else -1
+ */
+int  sui_event_stats(Sui *ui, unsigned *merged, unsigned *dropped);
+
+/**
+ *  \brief present frames from a background thread 
+ *
+ *  The thread owns the X connection from now on. sui_show only converts the 
+ *  frame and hands it over without blocking, the newest frame wins. sui_wait 
+ *  calls the callback with the events queued by the thread on the calling 
+ *  thread. sui_move, sui_resize and sui_lock_framebuffer fail until stopped.
+ *  Only for windows created by sui_create, not in a shared context.
+ *
+ *  \param ui valid pointer, if it's NULL, will do nothing
+ *  \return return 0 if OK, else -1
+ */
+int  sui_start_presenter(Sui *ui);
+
+/**
+ *  \brief stop the presenter thread, the calling thread owns the connection again
+ *
+ *  \param ui valid pointer, if it's NULL, will do nothing
+ *  \return return 0 if OK, else -1
+ */
+int  sui_stop_presenter(Sui *ui);
+
+/**
+ *  \brief check the pixel conversion kernels picked for this cpu against the scalar ones
+ *
+ *  Every kernel converts rows of odd widths and strides at each alignment,
+ *  the output has to be the same byte for byte. No display is needed, run it 
+ *  once after changing a kernel (build with -fsanitize=address to catch 
+ *  reads past the source too).
+ *
+ *  \return return 0 if all of them match, the number of mismatches, or -1 without memory
+ */
+int  sui_check_kernels(void);
+
 /**
  *  \brief release resources, set the pointer to zero 
  *